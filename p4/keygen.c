@@ -3,70 +3,366 @@
  * Course: CS 344
  */
 
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#include "otp.h"
+
+/* key chars generated and written out at a time */
+#define BLOCK 65536
+
+/* upper limit on the number of generating threads accepted with -t */
+#define MAX_THREADS 64
+
+/* random bytes at or above this are thrown away, so the ones kept fall
+   evenly on the OTP_SYMS key chars: 243 = 9 * 27 for A-Z and space, and
+   nothing at all for raw bytes */
+#define REJECT (256 - 256 % OTP_SYMS)
+
+/* with -n, the keys go out as one indexed pad: a PADHDR-byte header of
+   PADMAGIC and the key count, then count + 1 little-endian 64-bit file
+   offsets, then the keys, each ending in a newline.  Key i starts at the
+   i-th offset and its newline sits just before the next one. */
+#define PADMAGIC "OTPKEYS\n"
+#define PADHDR 16
+
+/* one block of key on its way from a generating thread to the writer */
+struct slot {
+    char buf[BLOCK];
+    size_t len;
+    int full;               /* 1 once generated, -1 if that failed */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* everything the generating threads share */
+struct keygen {
+    struct slot *slots;     /* two per thread, so one can be written out
+                               while the next is generated */
+    int nthreads;
+    size_t total, nblocks;  /* key chars to make, over every key */
+};
+
+/* a generating thread's share of the work */
+struct gen_arg {
+    struct keygen *kg;
+    int id;
+};
+
+
+size_t block_len(const struct keygen *kg, size_t block);
+int fill_random(unsigned char *buf, size_t len);
+void *generate(void *arg);
+int make_block(char *out, size_t len);
+void usage(const char *prog);
+int write_index(uint64_t nkeys, uint64_t keylen);
+
+
+/* Returns how many key chars go in the given block */
+size_t block_len(const struct keygen *kg, size_t block)
+{
+    size_t left = kg->total - block * BLOCK;
+
+    return (left < BLOCK) ? left : BLOCK;
+}
+
+
+/* Fills buf with len bytes from the kernel's CSPRNG, falling back to
+ * /dev/urandom on kernels without getrandom().  Returns 1 on success.
+ */
+int fill_random(unsigned char *buf, size_t len)
+{
+    ssize_t n;
+    int fd;
+
+    while (len > 0) {
+        n = getrandom(buf, len, 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && errno == ENOSYS) {
+            /* citation: http://stackoverflow.com/a/4930888 */
+            if ((fd = open("/dev/urandom", O_RDONLY)) < 0)
+                return 0;
+            while (len > 0 && (n = read(fd, buf, len)) > 0) {
+                buf += n;
+                len -= n;
+            }
+            close(fd);
+            return len == 0;
+        }
+
+        if (n <= 0)
+            return 0;
+
+        buf += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+
+/* Body of a generating thread: makes every nthreads-th block, starting
+ * with block id, handing each to the writer through the thread's own two
+ * slots
+ */
+void *generate(void *arg)
+{
+    struct keygen *kg = ((struct gen_arg *) arg)->kg;
+    int id = ((struct gen_arg *) arg)->id;
+    struct slot *slot;
+    size_t block;
+    int ok;
+
+    for (block = id; block < kg->nblocks; block += kg->nthreads) {
+        slot = &kg->slots[block % (2 * kg->nthreads)];
+
+        /* wait for the writer to be done with the slot's last block */
+        pthread_mutex_lock(&slot->lock);
+        while (slot->full)
+            pthread_cond_wait(&slot->cond, &slot->lock);
+        pthread_mutex_unlock(&slot->lock);
+
+        slot->len = block_len(kg, block);
+        ok = make_block(slot->buf, slot->len);
+
+        pthread_mutex_lock(&slot->lock);
+        slot->full = ok ? 1 : -1;
+        pthread_cond_signal(&slot->cond);
+        pthread_mutex_unlock(&slot->lock);
+
+        if (!ok)
+            break;
+    }
+
+    return NULL;
+}
+
+
+/* Fills out with len key chars.  Random bytes are drawn in bulk and
+ * each one kept is reduced mod the alphabet size; bytes that would favour
+ * the first few chars are rejected, so every char is equally likely.
+ * Returns 1 on success.
+ */
+int make_block(char *out, size_t len)
+{
+    unsigned char raw[BLOCK];
+    size_t n = 0, i, want;
+    unsigned char r;
+
+    while (n < len) {
+        /* at most half get rejected, about 5% for A-Z and space, so
+           ask for a little extra and go round again if need be */
+        want = (len - n) + (len - n) / 16 + 16;
+        if (want > sizeof(raw))
+            want = sizeof(raw);
+
+        if (!fill_random(raw, want))
+            return 0;
+
+        for (i = 0; i != want && n < len; ++i) {
+            if (raw[i] >= REJECT)
+                continue;
+            r = raw[i] % OTP_SYMS;
+            out[n++] = OTP_ALPHABET[r];
+        }
+    }
+
+    return 1;
+}
+
+
+/* Prints how to run this program and exits */
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-n count] keylength\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+
+/* Writes the header and offset index of an indexed pad of nkeys keys
+ * of keylen chars each to stdout.  Returns 1 on success.
+ */
+int write_index(uint64_t nkeys, uint64_t keylen)
+{
+    unsigned char hdr[PADHDR];
+    uint64_t i, off, le;
+
+    memcpy(hdr, PADMAGIC, 8);
+    le = htole64(nkeys);
+    memcpy(hdr + 8, &le, 8);
+    if (fwrite(hdr, 1, sizeof(hdr), stdout) != sizeof(hdr))
+        return 0;
+
+    /* every key is the same length, so the whole index is known before
+       a single key char has been made */
+    off = PADHDR + 8 * (nkeys + 1);
+    for (i = 0; i <= nkeys; ++i) {
+        le = htole64(off + i * (keylen + 1));
+        if (fwrite(&le, 1, 8, stdout) != 8)
+            return 0;
+    }
+
+    return 1;
+}
 
-#define SP_KEY 26
 
 int main(int argc, char *argv[])
 {
-    FILE *urandom;
-    unsigned int seed;
-    size_t keylen, r_ret_val;
-    char *key;
+    struct keygen kg;
+    struct gen_arg args[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    struct slot *slot;
+    size_t block, keylen, left, n, len;
+    char *pos;
+    int nthreads = 1, opt, i, ok = 1;
     char ch;
-    int i = 0;
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s keylength\n", argv[0]);
-        exit(EXIT_FAILURE);
+    /* keys to put in an indexed pad with -n, or 0 for a plain key */
+    uint64_t nkeys = 0;
+
+    while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+        switch (opt) {
+            case 'n': {
+                nkeys = strtoull(optarg, &pos, 10);
+                if (*optarg < '0' || *optarg > '9' || *pos || nkeys < 1) {
+                    fprintf(stderr, "keygen: key count must be a ");
+                    fprintf(stderr, "positive integer\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 't': {
+                nthreads = atoi(optarg);
+                if (nthreads < 1 || nthreads > MAX_THREADS) {
+                    fprintf(stderr, "keygen: thread count must be ");
+                    fprintf(stderr, "between 1 and %d\n", MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            default: {
+                usage(argv[0]);
+            }
+        }
     }
 
-    ch = argv[1][i];
+    if (argc - optind != 1)
+        usage(argv[0]);
+
+    i = 0;
+    ch = argv[optind][i];
     while (ch) {
         if (ch < '0' || ch > '9') {
             fprintf(stderr, "Usage: first parameter must be a non-negative integer\n");
             exit(EXIT_FAILURE);
         }
         ++i;
-        ch = argv[1][i];
+        ch = argv[optind][i];
     }
 
-    keylen = atoi(argv[1]);
+    keylen = strtoull(argv[optind], NULL, 10);
 
-    /* citation: http://stackoverflow.com/a/4930888 */
-    urandom = fopen("/dev/urandom", "r");
-    
-    if (urandom == NULL) {
-        fprintf(stderr, "Unable to open /dev/urandom for read\n");
-        exit(EXIT_FAILURE);
+    /* a pad holds its keys back to back, newlines aside */
+    kg.total = keylen;
+    if (nkeys) {
+        if (keylen == 0
+                || nkeys > (UINT64_MAX - PADHDR - 8) / (keylen + 9)) {
+            fprintf(stderr, "keygen: a pad needs keys of 1 or more chars ");
+            fprintf(stderr, "and must fit in 2^64 bytes\n");
+            exit(EXIT_FAILURE);
+        }
+        kg.total = nkeys * keylen;
     }
+    kg.nblocks = (kg.total + BLOCK - 1) / BLOCK;
+    kg.nthreads = nthreads;
 
-    /* citation: http://stackoverflow.com/a/4930888 */
-    r_ret_val = fread(&seed, sizeof(seed), 1, urandom);
-    if (r_ret_val < 1) {
-        fprintf(stderr, "Unable to get a seed from /dev/urandom\n");
-        fclose(urandom);
-        exit(EXIT_FAILURE);
-    }
+    /* no point in threads that would never get a block */
+    if ((size_t) kg.nthreads > kg.nblocks)
+        kg.nthreads = kg.nblocks ? kg.nblocks : 1;
 
-    fclose(urandom);
-    srand(seed);
-    
-    key = malloc((keylen + 1) * sizeof(char));
-    if (key == NULL) {
+    /* memory use depends only on the thread count, not the key length */
+    kg.slots = calloc(2 * kg.nthreads, sizeof(struct slot));
+    if (kg.slots == NULL) {
         fprintf(stderr, "Unable to allocate heap memory\n");
         exit(EXIT_FAILURE);
     }
 
-    for (i = 0; i != keylen; ++i) {
-        char rval = (char) (rand() % 27);
-        key[i] = (rval == SP_KEY) ? ' ' : rval + 'A';
+    for (i = 0; i != 2 * kg.nthreads; ++i) {
+        pthread_mutex_init(&kg.slots[i].lock, NULL);
+        pthread_cond_init(&kg.slots[i].cond, NULL);
+    }
+
+    for (i = 0; i != kg.nthreads; ++i) {
+        args[i].kg = &kg;
+        args[i].id = i;
+        if (pthread_create(&threads[i], NULL, generate, &args[i]) != 0) {
+            fprintf(stderr, "Unable to start generating thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* big blocks go straight through; the buffer is for the newlines */
+    setvbuf(stdout, NULL, _IOFBF, BLOCK);
+
+    if (nkeys)
+        ok = write_index(nkeys, keylen);
+
+    /* write the blocks out in order as they come ready, ending each key
+       with a newline */
+    left = keylen;
+    for (block = 0; ok && block != kg.nblocks; ++block) {
+        slot = &kg.slots[block % (2 * kg.nthreads)];
+
+        pthread_mutex_lock(&slot->lock);
+        while (!slot->full)
+            pthread_cond_wait(&slot->cond, &slot->lock);
+        pthread_mutex_unlock(&slot->lock);
+
+        if (slot->full < 0) {
+            fprintf(stderr, "Unable to get random bytes from the kernel\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (pos = slot->buf, n = slot->len; ok && n > 0; ) {
+            len = (left < n) ? left : n;
+            ok = fwrite(pos, 1, len, stdout) == len;
+            pos += len;
+            n -= len;
+            if ((left -= len) == 0) {
+                ok = ok && putchar('\n') != EOF;
+                left = keylen;
+            }
+        }
+
+        pthread_mutex_lock(&slot->lock);
+        slot->full = 0;
+        pthread_cond_signal(&slot->cond);
+        pthread_mutex_unlock(&slot->lock);
+    }
+
+    /* an empty key still gets its newline */
+    if (ok && keylen == 0)
+        ok = putchar('\n') != EOF;
+
+    if (!ok || fflush(stdout) != 0) {
+        fprintf(stderr, "Unable to write key\n");
+        exit(EXIT_FAILURE);
     }
-    key[keylen] = '\0';
 
-    puts(key);
-    free(key);
+    for (i = 0; i != kg.nthreads; ++i)
+        pthread_join(threads[i], NULL);
 
+    free(kg.slots);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,151 @@
+/* mkalpha.c
+ * Author: Jason Goldfine-Middleton
+ * Course: CS 344
+ *
+ * Writes otp_alpha.h, which fixes the alphabet messages and keys are
+ * made of for everything built against libotp.  With no argument the
+ * alphabet is the capital letters and space; otherwise it is the chars
+ * of the argument, in order, or with -x any byte at all, in which case
+ * messages are combined with their keys by XOR instead of mod the
+ * alphabet size.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* the alphabet used when none is given, which is the one the vector
+   kernels and the packing shortcuts are written for */
+#define LETTERS "ABCDEFGHIJKLMNOPQRSTUVWXYZ "
+
+
+void usage(const char *prog);
+void write_header(const unsigned char *alpha, int nsyms, int raw);
+
+
+/* Prints how to run this program and exits */
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-x | alphabet] > otp_alpha.h\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+
+/* Writes the header for the nsyms chars of alpha to stdout: the size of
+ * the alphabet as a constant, the alphabet itself, the tag the clients
+ * and daemons add to their handshake so builds with different alphabets
+ * never talk, and the table taking each char back to its place.
+ */
+void write_header(const unsigned char *alpha, int nsyms, int raw)
+{
+    short sym[256];
+    uint32_t hash = 2166136261u;
+    int i, letters;
+
+    letters = !raw && nsyms == (int) strlen(LETTERS)
+        && memcmp(alpha, LETTERS, nsyms) == 0;
+
+    for (i = 0; i != 256; ++i)
+        sym[i] = -1;
+    for (i = 0; i != nsyms; ++i) {
+        sym[alpha[i]] = i;
+        hash = (hash ^ alpha[i]) * 16777619u;
+    }
+
+    printf("/* otp_alpha.h\n");
+    printf(" * Generated by mkalpha from compileall; change the alphabet ");
+    printf("there.\n */\n\n");
+    printf("#ifndef OTP_ALPHA_H\n#define OTP_ALPHA_H\n\n");
+
+    printf("/* chars in the alphabet, and so the modulus */\n");
+    printf("#define OTP_SYMS %d\n\n", nsyms);
+    printf("/* 1 if messages are any bytes, XORed with their keys */\n");
+    printf("#define OTP_RAW %d\n\n", raw);
+    printf("/* 1 if the alphabet is A-Z and space, in that order */\n");
+    printf("#define OTP_LETTERS %d\n\n", letters);
+    printf("/* added to handshake signatures */\n");
+    if (letters)
+        printf("#define OTP_TAG \"\"\n\n");
+    else if (raw)
+        printf("#define OTP_TAG \" raw\"\n\n");
+    else
+        printf("#define OTP_TAG \" alphabet-%08x\"\n\n", (unsigned) hash);
+
+    /* every char as an octal escape, so any byte can go in the string */
+    printf("/* the chars themselves, in order */\n");
+    printf("#define OTP_ALPHABET");
+    for (i = 0; i != nsyms; ++i) {
+        if (i % 16 == 0)
+            printf(" \\\n    \"");
+        printf("\\%03o", alpha[i]);
+        if (i % 16 == 15 || i == nsyms - 1)
+            printf("\"");
+    }
+    printf("\n\n");
+
+    printf("#ifdef OTP_TABLES\n");
+    printf("/* each char's place in the alphabet, or -1 if it isn't in ");
+    printf("it */\nstatic const short otp_sym[256] = {");
+    for (i = 0; i != 256; ++i)
+        printf("%s%d,", (i % 16 == 0) ? "\n    " : " ", sym[i]);
+    printf("\n};\n#endif\n\n#endif\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned char alpha[256];
+    const char *chars = LETTERS;
+    int nsyms, opt, i, raw = 0;
+
+    while ((opt = getopt(argc, argv, "x")) != -1) {
+        switch (opt) {
+            case 'x': {
+                raw = 1;
+                break;
+            }
+            default: {
+                usage(argv[0]);
+            }
+        }
+    }
+
+    if (argc - optind > 1 || (raw && argc - optind != 0))
+        usage(argv[0]);
+    if (argc - optind == 1)
+        chars = argv[optind];
+
+    if (raw) {
+        for (i = 0; i != 256; ++i)
+            alpha[i] = i;
+        nsyms = 256;
+    } else {
+        /* a newline ends a message, so it can't be part of one */
+        nsyms = strlen(chars);
+        if (nsyms < 2 || strchr(chars, '\n')) {
+            fprintf(stderr, "mkalpha: an alphabet needs 2 or more chars, ");
+            fprintf(stderr, "none of them a newline\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i != nsyms; ++i) {
+            alpha[i] = chars[i];
+            if (memchr(chars, chars[i], i)) {
+                fprintf(stderr, "mkalpha: '%c' is in the alphabet twice\n",
+                        chars[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    write_header(alpha, nsyms, raw);
+
+    if (fflush(stdout) != 0) {
+        fprintf(stderr, "mkalpha: could not write header\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,658 @@
+/* otp.c
+ * Author: Jason Goldfine-Middleton
+ * Course: CS 344
+ */
+
+#include <endian.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* otp_alpha.h holds the char table for this file alone */
+#define OTP_TABLES
+#include "otp.h"
+
+/* vector kernels are only built for x86, and only for the alphabets they
+   are written for: A-Z and space, or raw bytes.  Everyone else gets
+   scalar, which still has the modulus as a constant. */
+#if (defined(__x86_64__) || defined(__i386__)) && (OTP_LETTERS || OTP_RAW)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/* the vector char scans are for A-Z and space; raw bytes need none */
+#if defined(HAVE_X86_KERNELS) && OTP_LETTERS
+#define HAVE_X86_SCANS
+#endif
+
+/* message and key chars check_kernel() runs every kernel over: every
+   pairing of two chars, up to a limit for big alphabets */
+#define CHECK_LEN (OTP_SYMS * OTP_SYMS < 1024 ? OTP_SYMS * OTP_SYMS : 1024)
+
+/* signature shared by all the OTP kernels: transform the first len chars
+   of msg with key into out, in the direction op, without
+   null-terminating */
+typedef void (*kernel_fn)(char *out, size_t len, const char *msg,
+        const char *key, int op);
+
+/* signature shared by the char scans: check that the len chars of buf
+   are all ones a message or key can hold, and find the first newline */
+typedef int (*validate_fn)(const char *buf, size_t len, size_t *linelen);
+
+
+static int check_kernel(kernel_fn kernel);
+static uint64_t load_group(const unsigned char *p, size_t len);
+static uint64_t spread(uint64_t x);
+static uint64_t squeeze(uint64_t x);
+static void store_group(unsigned char *p, uint64_t x, size_t len);
+static void transform_scalar(char *out, size_t len, const char *msg,
+        const char *key, int op);
+static int validate_scalar(const char *buf, size_t len, size_t *linelen);
+#ifdef HAVE_X86_KERNELS
+static void transform_avx2(char *out, size_t len, const char *msg,
+        const char *key, int op);
+static void transform_sse2(char *out, size_t len, const char *msg,
+        const char *key, int op);
+#endif
+#ifdef HAVE_X86_SCANS
+static int validate_avx2(const char *buf, size_t len, size_t *linelen);
+static int validate_sse2(const char *buf, size_t len, size_t *linelen);
+#endif
+
+/* the alphabet, each char at its place; otp_sym[] is the way back */
+static const char otp_char[OTP_SYMS] = OTP_ALPHABET;
+
+/* kernels used by otp_transform() and otp_validate(), picked by
+   otp_select() */
+static kernel_fn transform_kernel = transform_scalar;
+static validate_fn validate_kernel = validate_scalar;
+
+
+/* Runs kernel over every pairing of message and key chars, both ways,
+ * at a range of lengths and alignments so the vector bodies and scalar
+ * tails are both exercised, and compares against transform_scalar().
+ * Returns 1 if they agree everywhere.
+ */
+static int check_kernel(kernel_fn kernel)
+{
+    /* (message, key) pairs of symbols, plus slack for misaligned
+       starts */
+    char msg[CHECK_LEN + 64], key[CHECK_LEN + 64];
+    char want[CHECK_LEN + 64], got[CHECK_LEN + 64];
+    size_t i, len, off;
+    int op;
+
+    for (i = 0; i != sizeof(msg); ++i) {
+        msg[i] = otp_char[(i / OTP_SYMS) % OTP_SYMS];
+        key[i] = otp_char[i % OTP_SYMS];
+    }
+
+    for (op = OTP_ENCRYPT; op <= OTP_DECRYPT; ++op) {
+        for (off = 0; off != 32; ++off) {
+            for (len = 0; len <= CHECK_LEN; len += (len < 70) ? 1 : 37) {
+                transform_scalar(want, len, msg + off, key + off, op);
+                kernel(got, len, msg + off, key + off, op);
+                if (memcmp(want, got, len) != 0)
+                    return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+
+/* Reads a group of packed symbols: the first len (at most 5) bytes at p,
+ * as the low bits of a little-endian number
+ */
+static uint64_t load_group(const unsigned char *p, size_t len)
+{
+    uint64_t x = 0;
+
+    memcpy(&x, p, len);
+    return le64toh(x);
+}
+
+
+/* Finishes the transform in ctx, storing in *len how many chars it took
+ * in.  Returns 1 if every chunk was good, 0 if any held a char that
+ * isn't in the alphabet.
+ */
+int otp_final(struct otp_ctx *ctx, uint64_t *len)
+{
+    if (len)
+        *len = ctx->len;
+    return !ctx->bad;
+}
+
+
+/* Sets ctx up for a fresh transform in the direction op */
+void otp_init(struct otp_ctx *ctx, int op)
+{
+    ctx->op = op;
+    ctx->len = 0;
+    ctx->bad = 0;
+}
+
+
+/* Packs the first n chars of text into out, 5 bits a symbol: each char
+ * is its place in the alphabet, symbol i going in at bit 5i.  Bits past
+ * the last symbol are left clear.  out may be text, since each group of
+ * 8 chars is read before its 5 bytes are written.  Only alphabets of 32
+ * chars or fewer can be packed.
+ */
+void otp_pack(unsigned char *out, const char *text, size_t n)
+{
+#if OTP_LETTERS
+    const uint64_t ones = 0x0101010101010101ULL;
+#else
+    size_t j;
+#endif
+    uint64_t c;
+    size_t i, len;
+
+    for (i = 0; i < n; i += 8) {
+        len = (n - i < 8) ? n - i : 8;
+#if OTP_LETTERS
+        /* a short last group is made up with 'A's, which pack to 0 */
+        c = 0x41 * ones;
+        memcpy(&c, text + i, len);
+        c = le64toh(c);
+
+        /* a space is the only char without the 0x40 bit; move it up to
+           just past 'Z' so every char is then 'A' plus its symbol */
+        c += (~c >> 6 & ones) * 59;
+        c -= 0x41 * ones;
+#else
+        for (c = 0, j = 0; j != len; ++j)
+            c |= (uint64_t) (otp_sym[(unsigned char) text[i + j]] & 0x1F)
+                << 8 * j;
+#endif
+        store_group(out + i / 8 * 5, squeeze(c), otp_packed_size(len));
+    }
+}
+
+
+/* Returns the bytes taken by n symbols packed 5 bits apiece */
+uint64_t otp_packed_size(uint64_t n)
+{
+    return n / 8 * 5 + (n % 8 * 5 + 7) / 8;
+}
+
+
+/* Returns 1 if every one of the n symbols packed in in is in the
+ * alphabet, or 0 if any is OTP_SYMS or more, which 5 bits can hold for
+ * an alphabet of fewer than 32 chars.  Bits past the last symbol are not
+ * looked at.
+ */
+int otp_packed_valid(const unsigned char *in, size_t n)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t v, high = 0;
+    size_t g, len;
+
+    if (OTP_SYMS >= 32)
+        return 1;
+
+    for (g = 0; 8 * g < n; ++g) {
+        len = (n - 8 * g < 8) ? n - 8 * g : 8;
+        v = spread(load_group(in + 5 * g, otp_packed_size(len)));
+        if (len < 8)
+            v &= (1ULL << 8 * len) - 1;
+
+        /* a symbol of OTP_SYMS or more sets its byte's top bit */
+        high |= v + (128 - OTP_SYMS) * ones;
+    }
+
+    return !(high & 0x80 * ones);
+}
+
+
+/* Picks the fastest OTP kernel this CPU can run, or the one named by
+ * want ("avx2", "sse2" or "scalar") if not NULL, and installs it for
+ * otp_transform() once it has passed check_kernel(), along with the
+ * fastest char scan for otp_validate().  Returns the name of the kernel
+ * in use, which is "scalar" if the one picked failed its check, or NULL
+ * if want is not available here.
+ */
+const char *otp_select(const char *want)
+{
+    kernel_fn kernel = transform_scalar;
+    const char *name = "scalar";
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+
+    if ((!want || strcmp(want, "avx2") == 0)
+            && __builtin_cpu_supports("avx2")) {
+        kernel = transform_avx2;
+        name = "avx2";
+    } else if ((!want || strcmp(want, "sse2") == 0)
+            && __builtin_cpu_supports("sse2")) {
+        kernel = transform_sse2;
+        name = "sse2";
+    }
+
+#endif
+
+#ifdef HAVE_X86_SCANS
+    /* the scans only ever speed things up, so take the best there is */
+    if (__builtin_cpu_supports("avx2"))
+        validate_kernel = validate_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        validate_kernel = validate_sse2;
+#endif
+
+    if (want && strcmp(want, name) != 0)
+        return NULL;
+
+    /* never trust a kernel that disagrees with the reference */
+    if (!check_kernel(kernel)) {
+        kernel = transform_scalar;
+        name = "scalar";
+    }
+
+    transform_kernel = kernel;
+    return name;
+}
+
+
+/* Applies the OTP transformation in the direction op to the first len
+ * chars of msg with key, storing the result in out, which may be msg.
+ * Nothing is null-terminated.
+ */
+void otp_transform(int op, char *out, size_t len, const char *msg,
+        const char *key)
+{
+    transform_kernel(out, len, msg, key, op);
+}
+
+
+/* Packed counterpart of otp_transform(): transforms the n symbols packed
+ * in msg with those packed in key, packing the result into out, which
+ * may be msg.  Eight symbols at a time are spread a byte apiece across a
+ * 64-bit word, done all at once there, and squeezed back.
+ */
+void otp_transform_packed(int op, unsigned char *out, size_t n,
+        const unsigned char *msg, const unsigned char *key)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t m, k, t;
+    size_t i, len, bytes = otp_packed_size(n);
+
+    for (i = 0; i < bytes; i += 5) {
+        len = (bytes - i < 5) ? bytes - i : 5;
+        m = spread(load_group(msg + i, len));
+        k = spread(load_group(key + i, len));
+
+        /* no byte can carry into the next, and the ones that reach
+           OTP_SYMS are brought back down */
+        t = (op == OTP_DECRYPT) ? m + OTP_SYMS * ones - k : m + k;
+        t -= ((t + (128 - OTP_SYMS) * ones) >> 7 & ones) * OTP_SYMS;
+
+        store_group(out + i, squeeze(t), len);
+    }
+
+    /* clear any bits the key had past the last symbol */
+    if (5 * n % 8)
+        out[bytes - 1] &= (1 << (5 * n % 8)) - 1;
+}
+
+
+/* Unpacks n symbols packed by otp_pack() from in into chars in text.
+ * text may be in: groups are done from the last back, each read before
+ * its 8 chars are written.  Symbols from anyone else should be checked
+ * with otp_packed_valid() first.
+ */
+void otp_unpack(char *text, const unsigned char *in, size_t n)
+{
+#if OTP_LETTERS
+    const uint64_t ones = 0x0101010101010101ULL;
+#else
+    size_t j;
+#endif
+    uint64_t v;
+    size_t g, len;
+
+    for (g = (n + 7) / 8; g-- > 0; ) {
+        len = (n - 8 * g < 8) ? n - 8 * g : 8;
+        v = spread(load_group(in + 5 * g, otp_packed_size(len)));
+
+#if OTP_LETTERS
+        /* every symbol becomes 'A' plus itself, then 26 drops to space */
+        v += 0x41 * ones - ((v + 102 * ones) >> 7 & ones) * 59;
+        v = htole64(v);
+        memcpy(text + 8 * g, &v, len);
+#else
+        /* a symbol past the end of the alphabet is wrapped, not trusted */
+        for (j = 0; j != len; ++j)
+            text[8 * g + j] = otp_char[(v >> 8 * j & 0x1F) % OTP_SYMS];
+#endif
+    }
+}
+
+
+/* Transforms the next len chars of a message, from msg, with the next
+ * len chars of its key, from key, into out, which may be msg.  Chunks
+ * can be any size, as long as each brings as much key as message.  A
+ * chunk holding anything but chars of the alphabet is refused and
+ * nothing is written.  Returns 1 if the chunk was transformed.
+ */
+int otp_update(struct otp_ctx *ctx, char *out, const char *msg,
+        const char *key, size_t len)
+{
+    size_t msglen, keylen;
+
+    /* a newline passes the scan, but only ever ends a message */
+    if (!otp_validate(msg, len, &msglen) || msglen != len
+            || !otp_validate(key, len, &keylen) || keylen != len) {
+        ctx->bad = 1;
+        return 0;
+    }
+
+    transform_kernel(out, len, msg, key, ctx->op);
+    ctx->len += len;
+    return 1;
+}
+
+
+/* Verifies that the len chars of buf are only ones a message or key file
+ * can hold: chars of the alphabet and newlines.  Stores in *linelen the
+ * number of chars before the first newline (all of them if there is
+ * none, or if messages are raw bytes).  Returns 1 if buf is good, 0 if
+ * not.
+ */
+int otp_validate(const char *buf, size_t len, size_t *linelen)
+{
+    return validate_kernel(buf, len, linelen);
+}
+
+
+/* Spreads the eight 5-bit symbols in the low 40 bits of x out to a byte
+ * apiece, the first symbol in the lowest byte
+ */
+static uint64_t spread(uint64_t x)
+{
+    x = (x & 0xFFFFFULL) | ((x & 0xFFFFF00000ULL) << 12);
+    x = (x & 0x000003FF000003FFULL) | ((x & 0x000FFC00000FFC00ULL) << 6);
+    x = (x & 0x001F001F001F001FULL) | ((x & 0x03E003E003E003E0ULL) << 3);
+    return x;
+}
+
+
+/* Undoes spread(): packs the low 5 bits of each byte of x into 40 */
+static uint64_t squeeze(uint64_t x)
+{
+    x &= 0x1F1F1F1F1F1F1F1FULL;
+    x = (x & 0x001F001F001F001FULL) | ((x >> 3) & 0x03E003E003E003E0ULL);
+    x = (x & 0x000003FF000003FFULL) | ((x >> 6) & 0x000FFC00000FFC00ULL);
+    x = (x & 0xFFFFFULL) | ((x >> 12) & 0xFFFFF00000ULL);
+    return x;
+}
+
+
+/* Writes the low len (at most 5) bytes of the packed group x to p */
+static void store_group(unsigned char *p, uint64_t x, size_t len)
+{
+    x = htole64(x);
+    memcpy(p, &x, len);
+}
+
+
+#ifdef HAVE_X86_KERNELS
+/* AVX2 version of transform_scalar(), 32 chars at a time.  Spaces and
+ * the mod 27 wrap are handled with compare masks instead of branches;
+ * raw bytes are just XORed.
+ */
+__attribute__((target("avx2")))
+static void transform_avx2(char *out, size_t len, const char *msg,
+        const char *key, int op)
+{
+#if OTP_RAW
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        _mm256_storeu_si256((__m256i *) (out + i), _mm256_xor_si256(
+                    _mm256_loadu_si256((const __m256i *) (msg + i)),
+                    _mm256_loadu_si256((const __m256i *) (key + i))));
+    }
+#else
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i a = _mm256_set1_epi8('A');
+    const __m256i v26 = _mm256_set1_epi8(26);
+    const __m256i v27 = _mm256_set1_epi8(27);
+    __m256i b, k, ch;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        b = _mm256_loadu_si256((const __m256i *) (msg + i));
+        k = _mm256_loadu_si256((const __m256i *) (key + i));
+
+        /* 'A'-'Z' become 0-25, space becomes 26 */
+        b = _mm256_blendv_epi8(_mm256_sub_epi8(b, a), v26,
+                _mm256_cmpeq_epi8(b, sp));
+        k = _mm256_blendv_epi8(_mm256_sub_epi8(k, a), v26,
+                _mm256_cmpeq_epi8(k, sp));
+
+        /* combine and bring back into 0-26 */
+        if (op == OTP_DECRYPT)
+            ch = _mm256_add_epi8(_mm256_sub_epi8(b, k), v27);
+        else
+            ch = _mm256_add_epi8(b, k);
+        ch = _mm256_sub_epi8(ch, _mm256_and_si256(v27,
+                    _mm256_cmpgt_epi8(ch, v26)));
+
+        /* and back to letters, 26 turning into a space */
+        ch = _mm256_blendv_epi8(_mm256_add_epi8(ch, a), sp,
+                _mm256_cmpeq_epi8(ch, v26));
+
+        _mm256_storeu_si256((__m256i *) (out + i), ch);
+    }
+#endif
+
+    /* whatever doesn't fill a whole vector */
+    transform_scalar(out + i, len - i, msg + i, key + i, op);
+}
+#endif
+
+
+/* Reference OTP kernel, one char at a time.  Used as the fallback when
+ * no vector kernel is available and as the yardstick for check_kernel().
+ * Chars go to their places and back through the alphabet's tables, and
+ * with OTP_SYMS a constant the mod needs no division.  Raw bytes are
+ * just XORed, which is its own inverse.
+ */
+static void transform_scalar(char *out, size_t len, const char *msg,
+        const char *key, int op)
+{
+    size_t i;
+#if !OTP_RAW
+    /* unsigned, so a char outside the alphabet still lands on one in it
+       rather than before the start of the table */
+    unsigned int b, k;
+#endif
+
+    /* for the first len chars, get the new char from the
+       message and key and store it */
+    for (i = 0; i < len; ++i) {
+#if OTP_RAW
+        out[i] = msg[i] ^ key[i];
+#else
+        b = otp_sym[(unsigned char) msg[i]];
+        k = otp_sym[(unsigned char) key[i]];
+        out[i] = otp_char[(op == OTP_DECRYPT)
+            ? (b - k + OTP_SYMS) % OTP_SYMS : (b + k) % OTP_SYMS];
+#endif
+    }
+}
+
+
+#ifdef HAVE_X86_KERNELS
+/* SSE2 version of transform_scalar(), 16 chars at a time.  SSE2 has no
+ * byte blend, so selections are done with and/andnot/or.  Raw bytes are
+ * just XORed.
+ */
+__attribute__((target("sse2")))
+static void transform_sse2(char *out, size_t len, const char *msg,
+        const char *key, int op)
+{
+#if OTP_RAW
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        _mm_storeu_si128((__m128i *) (out + i), _mm_xor_si128(
+                    _mm_loadu_si128((const __m128i *) (msg + i)),
+                    _mm_loadu_si128((const __m128i *) (key + i))));
+    }
+#else
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i a = _mm_set1_epi8('A');
+    const __m128i v26 = _mm_set1_epi8(26);
+    const __m128i v27 = _mm_set1_epi8(27);
+    __m128i b, k, ch, m;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        b = _mm_loadu_si128((const __m128i *) (msg + i));
+        k = _mm_loadu_si128((const __m128i *) (key + i));
+
+        /* 'A'-'Z' become 0-25, space becomes 26 */
+        m = _mm_cmpeq_epi8(b, sp);
+        b = _mm_or_si128(_mm_andnot_si128(m, _mm_sub_epi8(b, a)),
+                _mm_and_si128(m, v26));
+        m = _mm_cmpeq_epi8(k, sp);
+        k = _mm_or_si128(_mm_andnot_si128(m, _mm_sub_epi8(k, a)),
+                _mm_and_si128(m, v26));
+
+        /* combine and bring back into 0-26 */
+        if (op == OTP_DECRYPT)
+            ch = _mm_add_epi8(_mm_sub_epi8(b, k), v27);
+        else
+            ch = _mm_add_epi8(b, k);
+        ch = _mm_sub_epi8(ch, _mm_and_si128(v27, _mm_cmpgt_epi8(ch, v26)));
+
+        /* and back to letters, 26 turning into a space */
+        m = _mm_cmpeq_epi8(ch, v26);
+        ch = _mm_or_si128(_mm_andnot_si128(m, _mm_add_epi8(ch, a)),
+                _mm_and_si128(m, sp));
+
+        _mm_storeu_si128((__m128i *) (out + i), ch);
+    }
+#endif
+
+    /* whatever doesn't fill a whole vector */
+    transform_scalar(out + i, len - i, msg + i, key + i, op);
+}
+#endif
+
+
+#ifdef HAVE_X86_SCANS
+/* AVX2 version of validate_scalar(), 32 chars at a time.  A char is a
+ * letter if subtracting 'A' leaves it at most 25 unsigned.
+ */
+__attribute__((target("avx2")))
+static int validate_avx2(const char *buf, size_t len, size_t *linelen)
+{
+    const __m256i a = _mm256_set1_epi8('A');
+    const __m256i v25 = _mm256_set1_epi8(25);
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i nl = _mm256_set1_epi8('\n');
+    __m256i b, t, isnl, ok;
+    unsigned int nlmask;
+    size_t i, tail;
+    int found = 0;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        b = _mm256_loadu_si256((const __m256i *) (buf + i));
+        t = _mm256_sub_epi8(b, a);
+        isnl = _mm256_cmpeq_epi8(b, nl);
+
+        ok = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(t, v25), t),
+                _mm256_or_si256(_mm256_cmpeq_epi8(b, sp), isnl));
+        if ((unsigned int) _mm256_movemask_epi8(ok) != 0xffffffffu)
+            return 0;
+
+        nlmask = _mm256_movemask_epi8(isnl);
+        if (!found && nlmask) {
+            *linelen = i + __builtin_ctz(nlmask);
+            found = 1;
+        }
+    }
+
+    /* whatever doesn't fill a whole vector */
+    if (!validate_scalar(buf + i, len - i, &tail))
+        return 0;
+    if (!found)
+        *linelen = i + tail;
+    return 1;
+}
+#endif
+
+
+/* Reference char scan, one char at a time.  Used as the fallback when
+ * no vector scan is available and for the tails the vector ones leave.
+ */
+static int validate_scalar(const char *buf, size_t len, size_t *linelen)
+{
+    size_t i;
+    int found = 0;
+
+    /* raw, any byte goes and a newline is just another one */
+    for (i = OTP_RAW ? len : 0; i != len; ++i) {
+        /* anything other than a char of the alphabet or a newline means
+           the file is invalid */
+        if (otp_sym[(unsigned char) buf[i]] < 0 && buf[i] != '\n')
+            return 0;
+
+        /* count up to the end of the first line */
+        if (buf[i] == '\n' && !found) {
+            *linelen = i;
+            found = 1;
+        }
+    }
+
+    if (!found)
+        *linelen = len;
+    return 1;
+}
+
+
+#ifdef HAVE_X86_SCANS
+/* SSE2 version of validate_scalar(), 16 chars at a time */
+__attribute__((target("sse2")))
+static int validate_sse2(const char *buf, size_t len, size_t *linelen)
+{
+    const __m128i a = _mm_set1_epi8('A');
+    const __m128i v25 = _mm_set1_epi8(25);
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i nl = _mm_set1_epi8('\n');
+    __m128i b, t, isnl, ok;
+    unsigned int nlmask;
+    size_t i, tail;
+    int found = 0;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        b = _mm_loadu_si128((const __m128i *) (buf + i));
+        t = _mm_sub_epi8(b, a);
+        isnl = _mm_cmpeq_epi8(b, nl);
+
+        ok = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(t, v25), t),
+                _mm_or_si128(_mm_cmpeq_epi8(b, sp), isnl));
+        if (_mm_movemask_epi8(ok) != 0xffff)
+            return 0;
+
+        nlmask = _mm_movemask_epi8(isnl);
+        if (!found && nlmask) {
+            *linelen = i + __builtin_ctz(nlmask);
+            found = 1;
+        }
+    }
+
+    /* whatever doesn't fill a whole vector */
+    if (!validate_scalar(buf + i, len - i, &tail))
+        return 0;
+    if (!found)
+        *linelen = i + tail;
+    return 1;
+}
+#endif
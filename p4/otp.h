@@ -0,0 +1,56 @@
+/* otp.h
+ * Author: Jason Goldfine-Middleton
+ * Course: CS 344
+ */
+
+#ifndef OTP_H
+#define OTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "otp_alpha.h"
+
+/* libotp: the one-time pad transform behind otp_enc_d and otp_dec_d,
+   for anything that wants it without a round trip to a daemon.  A
+   message and key are chars of the alphabet fixed at build time in
+   otp_alpha.h, by default capital letters and spaces; each message char
+   is shifted by its key char mod OTP_SYMS, a char counting as its place
+   in OTP_ALPHABET (A-Z as 0-25, space as 26 by default).  Built with
+   OTP_RAW, messages and keys are any bytes and are simply XORed, with no
+   newline ending them.  Messages and keys in an alphabet of 32 chars or
+   fewer can also be packed 5 bits a char (char i at bit 5i of a
+   little-endian bit stream, so 8 chars take 5 bytes).
+
+   Everything runs on portable scalar code until otp_select() has picked
+   the fastest kernels this CPU can run, which should be done once at
+   startup, before any threads are started. */
+
+/* directions a message can be taken in */
+#define OTP_ENCRYPT 0
+#define OTP_DECRYPT 1
+
+/* a transform taken a chunk at a time: set up with otp_init(), fed with
+   otp_update(), and checked with otp_final() */
+struct otp_ctx {
+    int op;             /* OTP_ENCRYPT or OTP_DECRYPT */
+    uint64_t len;       /* chars transformed so far */
+    int bad;            /* set once a chunk held a char it shouldn't */
+};
+
+int otp_final(struct otp_ctx *ctx, uint64_t *len);
+void otp_init(struct otp_ctx *ctx, int op);
+void otp_pack(unsigned char *out, const char *text, size_t n);
+uint64_t otp_packed_size(uint64_t n);
+int otp_packed_valid(const unsigned char *in, size_t n);
+const char *otp_select(const char *want);
+void otp_transform(int op, char *out, size_t len, const char *msg,
+        const char *key);
+void otp_transform_packed(int op, unsigned char *out, size_t n,
+        const unsigned char *msg, const unsigned char *key);
+void otp_unpack(char *text, const unsigned char *in, size_t n);
+int otp_update(struct otp_ctx *ctx, char *out, const char *msg,
+        const char *key, size_t len);
+int otp_validate(const char *buf, size_t len, size_t *linelen);
+
+#endif
@@ -0,0 +1,710 @@
+/* otp_bench.c
+ * Author: Jason Goldfine-Middleton
+ * Course: CS 344
+ *
+ * Load generator for otp_enc_d / otp_dec_d.  Runs a number of forked
+ * workers against a daemon, either flat out (closed loop) or at a fixed
+ * overall request rate (open loop), and writes throughput and latency
+ * percentiles as JSON.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "otp.h"
+
+/* most workers and message sizes accepted on the command line */
+#define MAX_WORKERS 1024
+#define MAX_SIZES 32
+
+/* framed protocol: every frame starts with a header of one type byte,
+   three reserved bytes, and two 64-bit big-endian lengths */
+#define FRAME_HDR 20
+#define OP_ENCRYPT 'E'
+#define OP_DECRYPT 'D'
+#define FRAME_RESULT 'R'
+
+/* ways of talking to the daemon */
+#define PROTO_FRAMED 0      /* one framed request per connection */
+#define PROTO_KEEPALIVE 1   /* every request on one framed connection */
+#define PROTO_LEGACY 2      /* two connections, newline-terminated data */
+
+/* what a daemon with no room for another client answers instead of its
+   signature */
+#define BUSY_SIG "I am busy"
+
+/* what a worker sends back to the parent ahead of its latencies */
+struct summary {
+    long requests;          /* latencies that follow */
+    long errors;            /* requests that failed */
+    long busy;              /* requests the daemon had no room for */
+    long long bytes;        /* message bytes successfully transformed */
+};
+
+/* everything a worker needs to know about the run */
+struct bench {
+    const char *addr;       /* port, or path of a Unix domain socket */
+    int proto;
+    int decrypt;            /* talk to otp_dec_d rather than otp_enc_d */
+    int verify;             /* check every reply against a local result */
+    long requests;          /* per worker, if no duration */
+    double duration;        /* seconds per worker, 0 to count requests */
+    double interval;        /* seconds between requests, 0 flat out */
+    size_t sizes[MAX_SIZES];
+    int nsizes;
+};
+
+
+int cmp_double(const void *a, const void *b);
+int connect_addr(const char *addr);
+int do_request(int *sockfd, const struct bench *b, const char *msg,
+        const char *key, size_t len, char *reply);
+int handshake(int sockfd, const struct bench *b, char *next, size_t nextsz);
+double now(void);
+void pack_header(unsigned char *hdr, int type, uint64_t len1, uint64_t len2);
+double percentile(const double *sorted, long n, double p);
+int parse_port(const char *addr);
+size_t parse_size(const char *s);
+int read_full(int sockfd, char *buf, size_t len);
+socklen_t unix_addr(struct sockaddr_un *addr, const char *path);
+void usage(const char *prog);
+void worker(const struct bench *b, int wfd, int id);
+int write_full(int fd, const char *buf, size_t len);
+
+
+/* qsort() comparison for latencies */
+int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* Opens a socket and connects it to the daemon at addr on this host: a
+ * port, or else the path of a Unix domain socket.  Returns the socket or
+ * -1.
+ */
+int connect_addr(const char *addr)
+{
+    int sockfd, portno, one = 1;
+    struct sockaddr_in serv_addr;
+    struct sockaddr_un un_addr;
+    socklen_t unlen;
+
+    if ((portno = parse_port(addr)) == 0) {
+        if (!(unlen = unix_addr(&un_addr, addr))
+                || (sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            return -1;
+
+        if (connect(sockfd, (struct sockaddr *) &un_addr, unlen) < 0) {
+            close(sockfd);
+            return -1;
+        }
+
+        return sockfd;
+    }
+
+    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    /* requests go out in several small writes; don't let Nagle sit on
+       them and skew the latencies */
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serv_addr.sin_port = htons(portno);
+
+    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+
+/* Runs one request for len chars of msg and key and reads the reply
+ * into reply.  With keep-alive, *sockfd holds the open connection
+ * between calls (-1 when there is none).  Returns 1 on success, or -1 if
+ * the daemon was too busy to take it.
+ */
+int do_request(int *sockfd, const struct bench *b, const char *msg,
+        const char *key, size_t len, char *reply)
+{
+    unsigned char hdr[FRAME_HDR];
+    int fd = *sockfd, ok;
+    char next[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    ssize_t rdb;
+    size_t got = 0;
+    uint64_t rlen = 0;
+    int i;
+
+    /* open (and for the old protocol, move) the connection */
+    if (fd < 0) {
+        if ((fd = connect_addr(b->addr)) < 0)
+            return 0;
+
+        if ((ok = handshake(fd, b, b->proto == PROTO_LEGACY ? next : NULL,
+                    sizeof(next))) <= 0) {
+            close(fd);
+            return ok;
+        }
+
+        if (b->proto == PROTO_LEGACY) {
+            close(fd);
+            if ((fd = connect_addr(next)) < 0)
+                return 0;
+        }
+    }
+
+    if (b->proto == PROTO_LEGACY) {
+        /* message ended by a newline, then just the key chars the
+           daemon reads before it hangs up, then read to EOF */
+        ok = write_full(fd, msg, len) && write_full(fd, "\n", 1)
+            && write_full(fd, key, len);
+
+        while (ok && got < len) {
+            rdb = read(fd, reply + got, len - got);
+            if (rdb <= 0)
+                ok = 0;
+            else
+                got += rdb;
+        }
+        close(fd);
+        return ok;
+    }
+
+    /* framed: one request frame out, one result frame back */
+    pack_header(hdr, b->decrypt ? OP_DECRYPT : OP_ENCRYPT, len, len);
+    ok = write_full(fd, (char *) hdr, sizeof(hdr))
+        && write_full(fd, msg, len) && write_full(fd, key, len)
+        && read_full(fd, (char *) hdr, sizeof(hdr));
+
+    if (ok) {
+        for (i = 0; i != 8; ++i)
+            rlen = (rlen << 8) | hdr[4 + i];
+        ok = hdr[0] == FRAME_RESULT && rlen == len
+            && read_full(fd, reply, len);
+    }
+
+    /* keep the connection for next time only if it is still usable */
+    if (b->proto == PROTO_KEEPALIVE && ok) {
+        *sockfd = fd;
+    } else {
+        close(fd);
+        *sockfd = -1;
+    }
+
+    return ok;
+}
+
+
+/* Sends the client signature for the protocol in use and checks the
+ * daemon's answer.  If next is given, the address the daemon proposes
+ * for the data connection is read into it.  Returns 1 on success, -1 if
+ * the daemon is too busy, or 0 if the handshake failed.
+ */
+int handshake(int sockfd, const struct bench *b, char *next, size_t nextsz)
+{
+    char sig[64], resp_sig[32], buffer[32];
+    size_t got = 0;
+    ssize_t rdb;
+    const char *name = b->decrypt ? "otp_dec" : "otp_enc";
+
+    snprintf(sig, sizeof(sig), "I am %s" OTP_TAG "%s", name,
+            (b->proto == PROTO_LEGACY) ? "" : " framed");
+    snprintf(resp_sig, sizeof(resp_sig), "I am %s_d", name);
+
+    /* a busy answer is shorter than the signature, so it is read up to
+       the hang-up that follows it */
+    memset(buffer, 0, sizeof(buffer));
+    if (!write_full(sockfd, sig, strlen(sig)))
+        return 0;
+    while (got < strlen(resp_sig) && (rdb = read(sockfd, buffer + got,
+                    strlen(resp_sig) - got)) > 0)
+        got += rdb;
+
+    if (strncmp(buffer, BUSY_SIG, strlen(BUSY_SIG)) == 0)
+        return -1;
+    if (strcmp(buffer, resp_sig) != 0)
+        return 0;
+
+    if (!next)
+        return 1;
+
+    /* the daemon hangs up once it has proposed the address */
+    got = 0;
+    memset(next, 0, nextsz);
+    while (got < nextsz - 1
+            && (rdb = read(sockfd, next + got, nextsz - 1 - got)) > 0)
+        got += rdb;
+
+    return got > 0;
+}
+
+
+/* Current monotonic time in seconds */
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Fills in a FRAME_HDR-byte frame header */
+void pack_header(unsigned char *hdr, int type, uint64_t len1, uint64_t len2)
+{
+    int i;
+
+    memset(hdr, 0, FRAME_HDR);
+    hdr[0] = type;
+    for (i = 0; i != 8; ++i) {
+        hdr[4 + i] = len1 >> (56 - 8 * i);
+        hdr[12 + i] = len2 >> (56 - 8 * i);
+    }
+}
+
+
+/* Nearest-rank percentile p (0-100) of the n sorted values */
+double percentile(const double *sorted, long n, double p)
+{
+    long rank;
+
+    if (n == 0)
+        return 0;
+
+    rank = (long) (p / 100 * n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+    return sorted[rank - 1];
+}
+
+
+/* Returns the port number if addr is all digits and a valid port, -1 if
+ * it is all digits but not a valid port, or 0 if it is to be taken as a
+ * Unix domain socket path
+ */
+int parse_port(const char *addr)
+{
+    const char *c;
+
+    for (c = addr; *c; ++c) {
+        if (*c < '0' || *c > '9')
+            return 0;
+    }
+
+    if (c == addr || c - addr > 5 || atoi(addr) < 1 || atoi(addr) > 65535)
+        return -1;
+
+    return atoi(addr);
+}
+
+
+/* Parses a message size with an optional K or M suffix; 0 if invalid */
+size_t parse_size(const char *s)
+{
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+
+    if (*end == 'K' || *end == 'k') {
+        n <<= 10;
+        ++end;
+    } else if (*end == 'M' || *end == 'm') {
+        n <<= 20;
+        ++end;
+    }
+
+    return (*end == '\0') ? (size_t) n : 0;
+}
+
+
+/* Reads exactly len bytes from sockfd into buf.  Returns 1 on success
+ * or 0 if the daemon hung up or the read failed first.
+ */
+int read_full(int sockfd, char *buf, size_t len)
+{
+    ssize_t rdb;
+
+    while (len > 0) {
+        rdb = read(sockfd, buf, len);
+
+        if (rdb < 0 && errno == EINTR)
+            continue;
+        if (rdb <= 0)
+            return 0;
+
+        buf += rdb;
+        len -= rdb;
+    }
+
+    return 1;
+}
+
+
+/* Fills in addr for the Unix domain socket at path, where a leading '@'
+ * names a socket in the abstract namespace.  Returns the length to pass
+ * along with addr, or 0 if the path is empty or too long.
+ */
+socklen_t unix_addr(struct sockaddr_un *addr, const char *path)
+{
+    size_t len = strlen(path);
+
+    if (len == 0 || len >= sizeof(addr->sun_path))
+        return 0;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len);
+
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + len;
+    }
+
+    return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+
+/* Prints how to run this program and exits */
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d] [-v] [-p framed|keepalive|legacy] ",
+            prog);
+    fprintf(stderr, "[-c workers] [-r rate]\n");
+    fprintf(stderr, "       [-n requests | -t seconds] [-s size[,size...]] ");
+    fprintf(stderr, "[-o outfile] port|socket\n");
+    exit(EXIT_FAILURE);
+}
+
+
+/* Body of a worker process: sends requests until its share of the run
+ * is done, timing each one, then writes a summary followed by all its
+ * latencies (in microseconds) to wfd.  In open-loop mode each request
+ * is timed from when it was due, not from when it went out, so a slow
+ * daemon can't hide its queueing delay.
+ */
+void worker(const struct bench *b, int wfd, int id)
+{
+    struct summary sum = { 0, 0, 0, 0 };
+    char *msg, *key, *reply, *expect;
+    double *lat = NULL, *grown, start, due, t0;
+    long max = 0, i;
+    size_t maxlen = 0, len;
+    int sockfd = -1, ok, j;
+    struct timespec ts;
+
+    for (j = 0; j != b->nsizes; ++j) {
+        if (b->sizes[j] > maxlen)
+            maxlen = b->sizes[j];
+    }
+
+    msg = malloc(maxlen);
+    key = malloc(maxlen);
+    reply = malloc(maxlen);
+    expect = malloc(maxlen);
+    if (!msg || !key || !reply || !expect) {
+        perror("otp_bench: could not allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    /* random message and key, different for every worker */
+    srand(time(0) ^ (getpid() << 8) ^ id);
+    for (len = 0; len != maxlen; ++len) {
+        msg[len] = OTP_ALPHABET[rand() % OTP_SYMS];
+        key[len] = OTP_ALPHABET[rand() % OTP_SYMS];
+    }
+
+    start = now();
+
+    for (i = 0; ; ++i) {
+        if (b->duration > 0 ? now() - start >= b->duration
+                : i >= b->requests)
+            break;
+
+        /* open loop: wait for this request's slot */
+        t0 = now();
+        if (b->interval > 0) {
+            due = start + i * b->interval;
+            if (due > t0) {
+                ts.tv_sec = (time_t) (due - t0);
+                ts.tv_nsec = (long) ((due - t0 - ts.tv_sec) * 1e9);
+                nanosleep(&ts, NULL);
+            }
+            t0 = due;
+        }
+
+        len = b->sizes[i % b->nsizes];
+        ok = do_request(&sockfd, b, msg, key, len, reply);
+
+        if (ok > 0 && b->verify) {
+            otp_transform(b->decrypt ? OTP_DECRYPT : OTP_ENCRYPT, expect,
+                    len, msg, key);
+            ok = memcmp(expect, reply, len) == 0;
+        }
+
+        if (ok <= 0) {
+            if (ok < 0)
+                ++sum.busy;
+            else
+                ++sum.errors;
+            continue;
+        }
+
+        if (sum.requests == max) {
+            max = max ? 2 * max : 1024;
+            if (!(grown = realloc(lat, max * sizeof(double)))) {
+                perror("otp_bench: could not allocate memory");
+                exit(EXIT_FAILURE);
+            }
+            lat = grown;
+        }
+        lat[sum.requests++] = (now() - t0) * 1e6;
+        sum.bytes += len;
+    }
+
+    if (sockfd >= 0)
+        close(sockfd);
+
+    write_full(wfd, (char *) &sum, sizeof(sum));
+    write_full(wfd, (char *) lat, sum.requests * sizeof(double));
+    close(wfd);
+    exit(EXIT_SUCCESS);
+}
+
+
+/* Writes all len bytes of buf to fd.  Returns 1 on success. */
+int write_full(int fd, const char *buf, size_t len)
+{
+    ssize_t wrb;
+
+    while (len > 0) {
+        wrb = write(fd, buf, len);
+
+        if (wrb < 0 && errno == EINTR)
+            continue;
+        if (wrb <= 0)
+            return 0;
+
+        buf += wrb;
+        len -= wrb;
+    }
+
+    return 1;
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct bench b;
+    struct summary sum;
+    int nworkers = 1, opt, i, status;
+    long total = 1000, n = 0, errors = 0, busy = 0;
+    long long bytes = 0;
+    double rate = 0, start, elapsed, mean = 0;
+    double *lat = NULL, *grown;
+    const char *outname = NULL, *protoname = "framed";
+    char *sizes = "17", *tok;
+    int (*pipes)[2];
+    pid_t *pids;
+    FILE *out = stdout;
+
+    memset(&b, 0, sizeof(b));
+    b.proto = PROTO_FRAMED;
+    otp_select(NULL);
+
+    while ((opt = getopt(argc, argv, "c:dn:o:p:r:s:t:v")) != -1) {
+        switch (opt) {
+            case 'c': {
+                nworkers = atoi(optarg);
+                if (nworkers < 1 || nworkers > MAX_WORKERS)
+                    usage(argv[0]);
+                break;
+            }
+            case 'd': {
+                b.decrypt = 1;
+                break;
+            }
+            case 'n': {
+                if ((total = atol(optarg)) < 1)
+                    usage(argv[0]);
+                break;
+            }
+            case 'o': {
+                outname = optarg;
+                break;
+            }
+            case 'p': {
+                protoname = optarg;
+                if (strcmp(optarg, "framed") == 0)
+                    b.proto = PROTO_FRAMED;
+                else if (strcmp(optarg, "keepalive") == 0)
+                    b.proto = PROTO_KEEPALIVE;
+                else if (strcmp(optarg, "legacy") == 0)
+                    b.proto = PROTO_LEGACY;
+                else
+                    usage(argv[0]);
+                break;
+            }
+            case 'r': {
+                if ((rate = atof(optarg)) <= 0)
+                    usage(argv[0]);
+                break;
+            }
+            case 's': {
+                sizes = optarg;
+                break;
+            }
+            case 't': {
+                if ((b.duration = atof(optarg)) <= 0)
+                    usage(argv[0]);
+                break;
+            }
+            case 'v': {
+                b.verify = 1;
+                break;
+            }
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 1)
+        usage(argv[0]);
+
+    b.addr = argv[optind];
+    if (parse_port(b.addr) < 0) {
+        fprintf(stderr, "otp_bench: received an invalid port number\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* message sizes are used round robin */
+    for (tok = strtok(sizes, ","); tok; tok = strtok(NULL, ",")) {
+        if (b.nsizes == MAX_SIZES || !(b.sizes[b.nsizes] = parse_size(tok))) {
+            fprintf(stderr, "otp_bench: bad message size %s\n", tok);
+            exit(EXIT_FAILURE);
+        }
+        ++b.nsizes;
+    }
+
+    /* split the work and the rate evenly between workers */
+    b.requests = (total + nworkers - 1) / nworkers;
+    if (rate > 0)
+        b.interval = nworkers / rate;
+
+    /* a daemon dropping a connection is an error to count, not a reason
+       for a worker to die */
+    signal(SIGPIPE, SIG_IGN);
+
+    pipes = malloc(nworkers * sizeof(*pipes));
+    pids = malloc(nworkers * sizeof(pid_t));
+    if (!pipes || !pids) {
+        perror("otp_bench: could not allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    start = now();
+
+    for (i = 0; i != nworkers; ++i) {
+        if (pipe(pipes[i]) < 0 || (pids[i] = fork()) < 0) {
+            perror("otp_bench: could not start worker");
+            exit(EXIT_FAILURE);
+        }
+
+        if (pids[i] == 0) {
+            close(pipes[i][0]);
+            worker(&b, pipes[i][1], i);
+        }
+        close(pipes[i][1]);
+    }
+
+    /* collect every worker's results, draining each pipe in turn */
+    for (i = 0; i != nworkers; ++i) {
+        if (!read_full(pipes[i][0], (char *) &sum, sizeof(sum))) {
+            fprintf(stderr, "otp_bench: worker %d died\n", i);
+            sum.requests = 0;
+            sum.errors = 0;
+            sum.busy = 0;
+            sum.bytes = 0;
+        }
+
+        if (!(grown = realloc(lat, (n + sum.requests + 1) * sizeof(double)))) {
+            perror("otp_bench: could not allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        lat = grown;
+
+        if (!read_full(pipes[i][0], (char *) (lat + n),
+                    sum.requests * sizeof(double)))
+            sum.requests = 0;
+
+        n += sum.requests;
+        errors += sum.errors;
+        busy += sum.busy;
+        bytes += sum.bytes;
+        close(pipes[i][0]);
+        waitpid(pids[i], &status, 0);
+    }
+
+    elapsed = now() - start;
+
+    qsort(lat, n, sizeof(double), cmp_double);
+    for (i = 0; i < n; ++i)
+        mean += lat[i] / n;
+
+    if (outname && !(out = fopen(outname, "w"))) {
+        fprintf(stderr, "otp_bench: could not write %s\n", outname);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"daemon\": \"%s\",\n",
+            b.decrypt ? "otp_dec_d" : "otp_enc_d");
+    fprintf(out, "  \"protocol\": \"%s\",\n", protoname);
+    fprintf(out, "  \"workers\": %d,\n", nworkers);
+    fprintf(out, "  \"target_rate\": %.3f,\n", rate);
+    fprintf(out, "  \"requests\": %ld,\n", n);
+    fprintf(out, "  \"errors\": %ld,\n", errors);
+    fprintf(out, "  \"busy\": %ld,\n", busy);
+    fprintf(out, "  \"elapsed_s\": %.6f,\n", elapsed);
+    fprintf(out, "  \"throughput_rps\": %.3f,\n", n / elapsed);
+    fprintf(out, "  \"throughput_bps\": %.3f,\n", bytes / elapsed);
+    fprintf(out, "  \"latency_us\": {\n");
+    fprintf(out, "    \"min\": %.3f,\n", n ? lat[0] : 0.0);
+    fprintf(out, "    \"mean\": %.3f,\n", mean);
+    fprintf(out, "    \"p50\": %.3f,\n", percentile(lat, n, 50));
+    fprintf(out, "    \"p95\": %.3f,\n", percentile(lat, n, 95));
+    fprintf(out, "    \"p99\": %.3f,\n", percentile(lat, n, 99));
+    fprintf(out, "    \"p99_9\": %.3f,\n", percentile(lat, n, 99.9));
+    fprintf(out, "    \"max\": %.3f\n", n ? lat[n - 1] : 0.0);
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    free(lat);
+    free(pipes);
+    free(pids);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -3,54 +3,536 @@
  * Course: CS 344
  */
 
+/* for memfd_create() and file seals on the shared memory ring */
+#define _GNU_SOURCE
+
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-/* size of buffer to hold plaintext contents, then key contents */
+#include "otp.h"
+
+/* size of buffer to hold the server's handshake reply */
 #define SIZEBUF 100000
 
 /* error exit codes */
 #define EBADFILE 1
 #define EBADPORT 2
 
+/* a server with no room for another client answers the handshake with
+   BUSY_SIG and the milliseconds to wait before trying again.  It is
+   tried BUSY_TRIES times in all, each wait lengthened by a random part
+   of a backoff that starts at BACKOFF_MS and doubles each time, up to
+   BACKOFF_MAX_MS. */
+#define BUSY_SIG "I am busy"
+#define BUSY_TRIES 8
+#define BACKOFF_MS 50
+#define BACKOFF_MAX_MS 5000
+
+/* appended to the handshake signature to keep the data exchange on the
+   handshake connection, sent as length-prefixed frames, instead of moving
+   to a port proposed by the server */
+#define FRAMED_SUFFIX " framed"
+
+/* appended instead to have the message and key streamed in chunks */
+#define STREAM_SUFFIX " stream"
+
+/* appended instead for frames whose message, key and result are packed
+   5 bits a char, each as its place in the alphabet, char i at bit 5i of
+   a little-endian bit stream; the frame header lengths still count
+   chars */
+#define PACKED_SUFFIX " packed"
+
+/* appended instead by a client on the same host, over a Unix domain
+   socket, to pass requests through shared memory.  It hands the server
+   a memfd, sealed against shrinking, as one byte of SCM_RIGHTS message,
+   and both map it as a ring of at least SHM_RING bytes.  Each request is
+   copied into the ring, message then key, and announced with a
+   SHM_DOORBELL-byte doorbell: a frame header and the 64-bit big-endian
+   offset into the ring.  The result is written over the message and
+   announced the same way, so only doorbells go through the socket. */
+#define SHM_SUFFIX " shm"
+#define SHM_DOORBELL (FRAME_HDR + 8)
+#define SHM_RING (16 << 20)
+
+/* bytes of message (and of key) per chunk in the streaming protocol */
+#define STREAM_CHUNK 65536
+
+/* framed protocol: every frame starts with a header of one type byte,
+   three reserved bytes, and two 64-bit big-endian lengths.  Requests
+   carry the message and key lengths, replies the result length. */
+#define FRAME_HDR 20
+#define OP_ENCRYPT 'E'      /* request: message and key follow */
+#define OP_DECRYPT 'D'
+#define FRAME_RESULT 'R'    /* reply: transformed message follows */
+#define FRAME_ERROR 'X'     /* reply: request refused, nothing follows */
+
+/* the request type this client sends, and the direction libotp is
+   asked to take it in when it is done here instead */
+#define FRAME_OP OP_DECRYPT
+#define OTP_OP OTP_DECRYPT
+
+/* printed after each result, as the message it came from ended in one,
+   unless messages are raw bytes and end wherever the file does */
+#define EOL (OTP_RAW ? "" : "\n")
+
+/* pad requests name one of the daemon's pads instead of sending key:
+   the second header byte is the pad, len1 the message length, and len2
+   the offset into the pad (the key number, for an indexed pad), or
+   PAD_NEXT to let the daemon pick one.  The result frame's len2 says
+   which offset was used. */
+#define OP_ENCRYPT_PAD 'e'
+#define OP_DECRYPT_PAD 'd'
+#define PAD_NEXT UINT64_MAX
+
+/* the pad request type this client sends, and whether the daemon may
+   pick the offset (only encryption should ever use fresh pad) */
+#define FRAME_PAD_OP OP_DECRYPT_PAD
+#define PAD_CLAIMS 0
+
+/* most pads a daemon can hold */
+#define MAX_PADS 16
+
+/* an indexed pad from keygen -n: a PADHDR-byte header of PADMAGIC and
+   the little-endian key count, then count + 1 little-endian file
+   offsets, key i starting at the i-th and ending with a newline just
+   before the next.  A key in one is given as "padfile:key". */
+#define PADMAGIC "OTPKEYS\n"
+#define PADHDR 16
+
+/* requests kept in flight per connection in batch mode unless -n says */
+#define BATCH_WINDOW 16
+
+/* one message to be sent as a framed request */
+struct request {
+    const char *ptfile;     /* message file */
+    const char *keyfile;    /* key file, or "@pad[:offset]" */
+    const char *ptdata;     /* message file, mapped to be checked and
+                               then sent from, so it is only read once */
+    const char *keydata;    /* the key within its mapped file, or NULL */
+    const char *keymap;     /* the whole mapped key file, or NULL */
+    size_t keymapsz;
+    int ptfd, keyfd;        /* the same files held open to sendfile()
+                               from, or -1 */
+    size_t ptsize;          /* size of the message file */
+    size_t len;             /* chars of message (and key) to send */
+    const char *outfile;    /* where the reply goes, NULL for stdout */
+    int pad;                /* daemon pad to use instead, or -1 */
+    uint64_t padoff;        /* offset into it, or PAD_NEXT */
+    int failed;             /* a batch entry that failed its checks when
+                               its turn came, and so was never sent */
+};
+
+int check_pair(struct request *r, const char *keyfile);
+int check_request(struct request *r);
+int connect_addr(const char *addr);
+int connect_server(const char *addr, const char *sig, const char *resp_sig,
+        size_t respsz, char *next, size_t nextsz);
+int find_key(const char *arg, char **fname, const char **padmap,
+        size_t *padsz, const char **key, size_t *len);
 int handshake(int sockfd, const char *sig, size_t sigsz,
-        const char *resp_sig, size_t respsz);
-int receive(int sockfd, char *buf, size_t bufsz);
-int transmit(int sockfd, const char *rfile);
-int validate_file(const char *fname);
+        const char *resp_sig, size_t respsz, char *next, size_t nextsz,
+        long *retry_ms);
+void pack_header(unsigned char *hdr, int type, uint64_t len1, uint64_t len2);
+const char *map_file(const char *fname, size_t *size, int *fd);
+int parse_pad(const char *arg, uint64_t *off);
+int parse_port(const char *addr);
+int pipeline(int sockfd, struct request *reqs, int nreqs, int window);
+int pipeline_shm(int sockfd, struct request *reqs, int nreqs, int window);
+int read_full(int sockfd, char *buf, size_t len);
+int read_manifest(const char *fname, struct request **reqs);
+int receive(int sockfd, FILE *out);
+void report_unanswered(const struct request *reqs, int nrecv, int nsent,
+        int nreqs);
+int run_batch(struct request *reqs, int nreqs, const char *addr,
+        const char *sig, const char *resp_sig, size_t respsz, int nconns,
+        int window);
+int run_local(struct request *reqs, int nreqs);
+ssize_t send_range(int sockfd, int fd, off_t base, const char *data,
+        size_t *off, size_t count);
+char *send_ring(int sockfd, uint64_t size);
+int transmit(int sockfd, int fd, off_t base, const char *data,
+        size_t len);
+int transmit_stream(int sockfd, const struct request *r, size_t len);
+socklen_t unix_addr(struct sockaddr_un *addr, const char *path);
+void unmap_request(struct request *r);
+int unpack_header(const unsigned char *hdr, uint64_t *len1, uint64_t *len2);
+void usage(const char *prog);
+int write_full(int sockfd, const char *buf, size_t len);
+int write_packed(FILE *out, const unsigned char *in, size_t len,
+        uint64_t *syms, unsigned char *grp, size_t *ngrp);
+
+
+/* set by -P to send frames packed 5 bits a char */
+int packed = 0;
+
+/* set by -M to pass requests through a ring of shared memory */
+int shm = 0;
+
+/* set by -f to do the requests here when the server can't be reached */
+int fallback = 0;
+
+
+/* Makes sure a request's message file and the given key file exist,
+ * hold only characters the server can handle, and that the key is long
+ * enough.  Each file is mapped and scanned once, and the request keeps
+ * the mappings to send from, until unmap_request().  Stores the message
+ * length in r->len and returns 1, or prints what is wrong and returns 0.
+ * With no key file, only the message is checked.
+ */
+int check_pair(struct request *r, const char *keyfile)
+{
+    size_t keysize, keylen;
+
+    /* ensure that first file arg exists */
+    if (!(r->ptdata = map_file(r->ptfile, &r->ptsize, &r->ptfd))) {
+        fprintf(stderr, "otp_dec: could not access file %s\n", r->ptfile);
+        return 0;
+    }
+
+    /* ensure that second file arg exists */
+    if (keyfile && !(r->keydata = map_file(keyfile, &keysize, &r->keyfd))) {
+        fprintf(stderr, "otp_dec: could not access file %s\n", keyfile);
+        return 0;
+    }
+    if (keyfile) {
+        r->keymap = r->keydata;
+        r->keymapsz = keysize;
+    }
+
+    /* ensure that key is at least as big as plaintext file */
+    if (keyfile && r->ptsize > keysize) {
+        fprintf(stderr, "otp_dec: key file smaller than plaintext file\n");
+        return 0;
+    }
+
+    /* verify the characters present in the plaintext file */
+    if (!otp_validate(r->ptdata, r->ptsize, &r->len)) {
+        fprintf(stderr, "otp_dec: plaintext file %s ", r->ptfile);
+        fprintf(stderr, "contained invalid characters\n");
+        return 0;
+    }
+
+    /* a pad on the server is the server's to check */
+    if (!keyfile)
+        return 1;
+
+    /* verify the characters present in the key file */
+    if (!otp_validate(r->keydata, keysize, &keylen)) {
+        fprintf(stderr, "otp_dec: key file %s ", keyfile);
+        fprintf(stderr, "contained invalid characters\n");
+        return 0;
+    }
+
+    /* the key's first line has to cover the whole message too */
+    if (r->len > keylen) {
+        fprintf(stderr, "otp_dec: key file smaller than plaintext file\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/* Works out whether a request's key is a file, a key in an indexed pad
+ * file, or one of the server's pads, then checks it as check_pair()
+ * does.  Returns 1 if the request is good to send, or prints what is
+ * wrong and returns 0.
+ */
+int check_request(struct request *r)
+{
+    char *fname;
+    size_t keylen;
+    int res;
+
+    if ((r->pad = parse_pad(r->keyfile, &r->padoff)) == -2) {
+        fprintf(stderr, "otp_dec: bad pad %s; ", r->keyfile);
+        fprintf(stderr, PAD_CLAIMS ? "expected @pad or @pad:offset\n"
+                : "expected @pad:offset\n");
+        return 0;
+    }
+
+    r->keydata = r->keymap = NULL;
+    r->ptfd = r->keyfd = -1;
+    if (r->pad >= 0)
+        return check_pair(r, NULL);
+
+    if ((res = find_key(r->keyfile, &fname, &r->keymap, &r->keymapsz,
+                    &r->keydata, &keylen)) < 0)
+        return 0;
+    if (res == 0)
+        return check_pair(r, r->keyfile);
+
+    /* find_key() has already checked the key itself, which is sent from
+       the pad file like any other */
+    r->keyfile = fname;
+    r->keyfd = open(fname, O_RDONLY);
+    if (!check_pair(r, NULL))
+        return 0;
+
+    if (r->len > keylen) {
+        fprintf(stderr, "otp_dec: key in %s smaller than plaintext ", fname);
+        fprintf(stderr, "file\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/* Opens a socket and connects it to the server at addr on this host:
+ * a port number, or else the path of a Unix domain socket.  Returns the
+ * socket, -1 if no socket could be opened, or -2 if the connection
+ * failed.
+ */
+int connect_addr(const char *addr)
+{
+    int sockfd, portno;
+    struct sockaddr_in serv_addr;
+    struct sockaddr_un un_addr;
+    socklen_t unlen;
+    struct hostent *server;
+
+    /* a local socket skips the name lookup and the TCP stack entirely */
+    if ((portno = parse_port(addr)) == 0) {
+        if (!(unlen = unix_addr(&un_addr, addr)))
+            return -2;
+
+        if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            return -1;
+
+        if (connect(sockfd, (struct sockaddr *) &un_addr, unlen) < 0) {
+            close(sockfd);
+            return -2;
+        }
+
+        return sockfd;
+    }
+
+    /* get information about this host */
+    if ((server = gethostbyname("localhost")) == NULL)
+        return -2;
+
+    /* try to open a socket to connect with server on */
+    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    serv_addr.sin_port = htons(portno);
+
+    /* attempt to connect to the server */
+    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        close(sockfd);
+        return -2;
+    }
+
+    return sockfd;
+}
+
+
+/* Connects to the server at addr and exchanges signatures with it, as
+ * connect_addr() and handshake() do.  A server with no room yet is tried
+ * again after the wait it asks for plus a random share of an
+ * exponential backoff, so clients turned away together don't all come
+ * back together.  Returns the socket, -1 if no socket could be opened,
+ * -2 if the connection failed, -3 if the handshake failed, or -4 if the
+ * server was still busy after BUSY_TRIES tries.
+ */
+int connect_server(const char *addr, const char *sig, const char *resp_sig,
+        size_t respsz, char *next, size_t nextsz)
+{
+    struct timespec ts;
+    long retry, backoff = BACKOFF_MS;
+    int sockfd, res, tries;
+
+    for (tries = 0; tries != BUSY_TRIES; ++tries) {
+        if ((sockfd = connect_addr(addr)) < 0)
+            return sockfd;
+
+        res = handshake(sockfd, sig, strlen(sig) + 1, resp_sig, respsz,
+                next, nextsz, &retry);
+        if (res > 0)
+            return sockfd;
+
+        close(sockfd);
+        if (res == 0)
+            return -3;
+
+        retry += rand() % (backoff + 1);
+        if ((backoff *= 2) > BACKOFF_MAX_MS)
+            backoff = BACKOFF_MAX_MS;
+
+        ts.tv_sec = retry / 1000;
+        ts.tv_nsec = retry % 1000 * 1000000L;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+
+    return -4;
+}
+
+
+/* Looks for a key argument of the form "padfile:key" naming one key of
+ * an indexed pad; arg is taken as a plain key file instead if a file of
+ * that name exists.  The key is found through the pad's index without
+ * reading any other key, and its chars are checked.  Stores the pad's
+ * file name (allocated), the pad's mapping and its size, the key within
+ * it (kept to send from), and its length, then returns 1.  Returns 0 if
+ * arg is a plain key file, or prints what is wrong and returns -1.
+ */
+int find_key(const char *arg, char **fname, const char **padmap,
+        size_t *padsz, const char **key, size_t *len)
+{
+    const char *colon = strrchr(arg, ':');
+    const uint64_t *index;
+    uint64_t keyno = PAD_NEXT, nkeys, start, end;
+    size_t linelen;
+    struct stat st;
+    char *map, *numend;
+    int fd;
+
+    if (stat(arg, &st) < 0 && colon && colon[1]) {
+        keyno = strtoull(colon + 1, &numend, 10);
+        if (*numend || colon[1] < '0' || colon[1] > '9')
+            keyno = PAD_NEXT;
+    }
+
+    if (keyno == PAD_NEXT)
+        *fname = strdup(arg);
+    else
+        *fname = strndup(arg, colon - arg);
+    if (!*fname) {
+        perror("otp_dec: could not allocate memory");
+        return -1;
+    }
+
+    /* anything that can't be mapped is left to check_pair() to report,
+       as is anything not an indexed pad unless a key was asked for */
+    map = MAP_FAILED;
+    if ((fd = open(*fname, O_RDONLY)) >= 0) {
+        if (fstat(fd, &st) == 0 && st.st_size >= PADHDR)
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    if (map == MAP_FAILED || memcmp(map, PADMAGIC, 8) != 0) {
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        if (keyno != PAD_NEXT) {
+            fprintf(stderr, "otp_dec: %s is not an indexed pad\n", *fname);
+            free(*fname);
+            return -1;
+        }
+        free(*fname);
+        return 0;
+    }
+
+    memcpy(&nkeys, map + 8, 8);
+    nkeys = le64toh(nkeys);
+    index = (const uint64_t *) (map + PADHDR);
+
+    if (keyno == PAD_NEXT) {
+        fprintf(stderr, "otp_dec: %s is a pad of %llu keys; pick one ",
+                arg, (unsigned long long) nkeys);
+        fprintf(stderr, "with %s:key\n", arg);
+    } else if (keyno >= nkeys
+            || nkeys >= (uint64_t) (st.st_size - PADHDR) / 8) {
+        fprintf(stderr, "otp_dec: %s has no key %llu\n", *fname,
+                (unsigned long long) keyno);
+    } else {
+        start = le64toh(index[keyno]);
+        end = le64toh(index[keyno + 1]);
+
+        /* the key runs up to its newline, and has no other */
+        if (start < PADHDR + 8 * (nkeys + 1) || end <= start
+                || end > (uint64_t) st.st_size || map[end - 1] != '\n') {
+            fprintf(stderr, "otp_dec: %s has a bad index\n", *fname);
+        } else if (!otp_validate(map + start, end - 1 - start, &linelen)
+                || linelen != end - 1 - start) {
+            fprintf(stderr, "otp_dec: key %llu in %s ",
+                    (unsigned long long) keyno, *fname);
+            fprintf(stderr, "contained invalid characters\n");
+        } else {
+            *padmap = map;
+            *padsz = st.st_size;
+            *key = map + start;
+            *len = linelen;
+            return 1;
+        }
+    }
+
+    munmap(map, st.st_size);
+    free(*fname);
+    return -1;
+}
 
 
 /* Attempts to send a signature to the server, then reads the
  * signature sent back from the server to determine whether
- * a port number will be forthcoming.  If so, returns the port.
+ * an address will be forthcoming.  If next is given, the address (a
+ * port, or a socket name) is read into it.  Returns 1 once the
+ * signatures match and any address is in, -1 if the server is too busy
+ * (storing the milliseconds it asks us to wait in *retry_ms), otherwise
+ * 0.
  */
 int handshake(int sockfd, const char *sig, size_t sigsz,
-        const char *resp_sig, size_t respsz)
+        const char *resp_sig, size_t respsz, char *next, size_t nextsz,
+        long *retry_ms)
 {
     char buffer[SIZEBUF];
-    char port[6];
+    size_t got = 0;
+    ssize_t rdb;
     memset(buffer, 0, sizeof(buffer));
 
     /* send the client signature and read the server's response */
     write(sockfd, sig, sigsz - 1);
     read(sockfd, buffer, respsz - 1);
 
-    /* assuming we connected to correct server, read the port it
-       wants to use for future communication */
+    /* assuming we connected to correct server, read the address it
+       wants to use for future communication; it hangs up after that */
     if (strcmp(resp_sig, buffer) == 0) {
-        memset(port, 0, sizeof(port));
-        read(sockfd, port, sizeof(port) - 1);
+        if (!next)
+            return 1;
 
-        /* return the port number */
-        return atoi(port);
+        memset(next, 0, nextsz);
+        while (got < nextsz - 1
+                && (rdb = read(sockfd, next + got, nextsz - 1 - got)) > 0)
+            got += rdb;
+
+        return got > 0;
+    }
+
+    /* a busy server says how long to give it, then hangs up */
+    if (strncmp(buffer, BUSY_SIG, strlen(BUSY_SIG)) == 0) {
+        got = strlen(buffer);
+        while (got < sizeof(buffer) - 1 && (rdb = read(sockfd, buffer + got,
+                        sizeof(buffer) - 1 - got)) > 0)
+            got += rdb;
+
+        *retry_ms = strtol(buffer + strlen(BUSY_SIG), NULL, 10);
+        if (*retry_ms < 0)
+            *retry_ms = 0;
+        return -1;
     }
 
     /* handshake failed */
@@ -58,225 +540,1407 @@ int handshake(int sockfd, const char *sig, size_t sigsz,
 }
 
 
-/* Reads the decrypted message from the server on sockfd into buf */
-int receive(int sockfd, char *buf, size_t bufsz)
+/* Fills in a FRAME_HDR-byte frame header */
+void pack_header(unsigned char *hdr, int type, uint64_t len1, uint64_t len2)
+{
+    int i;
+
+    memset(hdr, 0, FRAME_HDR);
+    hdr[0] = type;
+    for (i = 0; i != 8; ++i) {
+        hdr[4 + i] = len1 >> (56 - 8 * i);
+        hdr[12 + i] = len2 >> (56 - 8 * i);
+    }
+}
+
+
+/* Maps the file fname read-only, so that it can be checked and then
+ * sent without being read a second time.  Stores its size in *size, and
+ * the file, left open for sendfile(), in *fd.  Returns the mapping, or
+ * NULL if the file can't be read.
+ */
+const char *map_file(const char *fname, size_t *size, int *fd)
+{
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    if ((*fd = open(fname, O_RDONLY)) < 0)
+        return NULL;
+
+    if (fstat(*fd, &st) == 0) {
+        *size = st.st_size;
+
+        /* an empty file can't be mapped, but then there's nothing in it
+           to read; otherwise all of it is about to be, so fault it in
+           up front */
+        if (st.st_size == 0)
+            map = (void *) "";
+        else
+            map = mmap(NULL, st.st_size, PROT_READ,
+                    MAP_PRIVATE | MAP_POPULATE, *fd, 0);
+    }
+
+    if (map == MAP_FAILED) {
+        close(*fd);
+        *fd = -1;
+        return NULL;
+    }
+
+    return map;
+}
+
+
+/* Reads a key argument naming one of the server's pads: "@pad" to have
+ * the server pick the offset, or "@pad:offset".  Stores the offset (or
+ * PAD_NEXT) in *off and returns the pad number, -1 if arg is not a pad
+ * at all, or -2 if it is malformed or lacks an offset it needs.
+ */
+int parse_pad(const char *arg, uint64_t *off)
+{
+    char *end;
+    long pad;
+
+    if (arg[0] != '@')
+        return -1;
+
+    pad = strtol(arg + 1, &end, 10);
+    if (end == arg + 1 || pad < 0 || pad >= MAX_PADS)
+        return -2;
+
+    *off = PAD_NEXT;
+    if (*end == ':') {
+        arg = end + 1;
+        *off = strtoull(arg, &end, 10);
+        if (end == arg || *off == PAD_NEXT)
+            return -2;
+    }
+
+    if (*end != '\0' || (*off == PAD_NEXT && !PAD_CLAIMS))
+        return -2;
+
+    return (int) pad;
+}
+
+
+/* Tells what kind of server address addr is.  Returns the port number
+ * if it is all digits and a valid port, -1 if it is all digits but not
+ * a valid port, or 0 if it is to be taken as a Unix domain socket path.
+ */
+int parse_port(const char *addr)
+{
+    const char *c;
+
+    for (c = addr; *c; ++c) {
+        if (*c < '0' || *c > '9')
+            return 0;
+    }
+
+    if (c == addr || c - addr > 5 || atoi(addr) < 1 || atoi(addr) > 65535)
+        return -1;
+
+    return atoi(addr);
+}
+
+
+/* Sends the nreqs requests in reqs over one framed connection on
+ * sockfd without waiting for each reply before sending the next, keeping
+ * at most window requests unanswered (no limit if window is 0).  Replies
+ * come back in order and are copied to each request's output as they
+ * arrive, followed by a newline.  A batch entry is only checked and
+ * mapped as it goes out, and each request is unmapped once its reply is
+ * in, so only the window's files are held.  The socket is made
+ * non-blocking and sending and receiving are interleaved so neither side
+ * stalls on a full socket buffer.  Returns the number of requests the
+ * server refused or that failed their checks, or -1 if the connection
+ * broke before every reply was in.
+ */
+int pipeline(int sockfd, struct request *reqs, int nreqs, int window)
+{
+    /* send side: the next request to go out, which part of it is going
+       (0 header, 1 message, 2 key), and how much of that part is gone */
+    int nsent = 0, phase = 0;
+    unsigned char shdr[FRAME_HDR];
+    size_t hsent = 0, poff = 0, koff = 0;
+
+    /* what actually goes out for the message and key, sendlen bytes of
+       each: the files themselves, or with -P a packed copy and no fds */
+    const char *ptsrc = NULL, *keysrc = NULL;
+    int ptfd = -1, keyfd = -1;
+    off_t keybase = 0;
+    size_t sendlen = 0;
+    unsigned char *packbuf = NULL;
+
+    /* receive side: the request being answered, how much of its reply
+       header is in, how much payload is left, and where it goes */
+    int nrecv = 0, refused = 0;
+    unsigned char rhdr[FRAME_HDR];
+    size_t hgot = 0;
+    uint64_t left = 0, padoff;
+    FILE *out = NULL;
+
+    /* with -P, the chars of the reply still to write, and a packed
+       group split between reads */
+    uint64_t syms = 0;
+    unsigned char grp[5];
+    size_t ngrp = 0;
+
+    char buffer[STREAM_CHUNK];
+    char *pos;
+    size_t n, avail;
+    ssize_t rwb;
+    struct pollfd pfd;
+    struct request *r;
+    int broken = 0, one = 1;
+
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+    /* the tail of each request is a small write; send it right away
+       rather than holding it until the server ACKs what came before */
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    while (!broken && nrecv < nreqs) {
+        /* no reply is coming for an entry that was never sent */
+        while (nrecv < nsent && reqs[nrecv].failed)
+            ++nrecv;
+        if (nrecv == nreqs)
+            break;
+
+        pfd.fd = sockfd;
+        pfd.events = POLLIN;
+        if (nsent < nreqs && (window <= 0 || nsent - nrecv < window))
+            pfd.events |= POLLOUT;
+
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno != EINTR)
+                broken = 1;
+            continue;
+        }
+
+        /* take in whatever reply bytes are ready */
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            rwb = read(sockfd, buffer, sizeof(buffer));
+            if (rwb == 0 || (rwb < 0 && errno != EAGAIN && errno != EINTR)) {
+                broken = 1;
+                continue;
+            }
+
+            for (pos = buffer, avail = (rwb > 0) ? rwb : 0; avail > 0; ) {
+                r = &reqs[nrecv];
+
+                if (hgot < FRAME_HDR) {
+                    /* still assembling the reply header */
+                    n = (FRAME_HDR - hgot < avail) ? FRAME_HDR - hgot : avail;
+                    memcpy(rhdr + hgot, pos, n);
+                    hgot += n;
+                    pos += n;
+                    avail -= n;
+                    if (hgot < FRAME_HDR)
+                        break;
+
+                    if (unpack_header(rhdr, &left, &padoff) != FRAME_RESULT) {
+                        fprintf(stderr, "otp_dec: server refused the ");
+                        fprintf(stderr, "request for %s\n", r->ptfile);
+                        ++refused;
+                        left = 0;
+                    } else {
+                        /* a packed reply's length counts chars */
+                        if (packed) {
+                            syms = left;
+                            left = otp_packed_size(syms);
+                            ngrp = 0;
+                        }
+
+                        /* the offset is needed again to decrypt */
+                        if (r->pad >= 0 && r->padoff == PAD_NEXT)
+                            fprintf(stderr, "otp_dec: %s used pad "
+                                    "@%d:%llu\n", r->ptfile, r->pad,
+                                    (unsigned long long) padoff);
+
+                        if (!r->outfile) {
+                            out = stdout;
+                        } else if (!(out = fopen(r->outfile, "w"))) {
+                            fprintf(stderr, "otp_dec: could not write %s\n",
+                                    r->outfile);
+                            ++refused;
+                        }
+                    }
+                } else {
+                    /* payload for the current reply */
+                    n = (left < avail) ? left : avail;
+                    if (out && packed)
+                        write_packed(out, (unsigned char *) pos, n, &syms,
+                                grp, &ngrp);
+                    else if (out)
+                        fwrite(pos, 1, n, out);
+                    pos += n;
+                    avail -= n;
+                    left -= n;
+                }
+
+                /* reply complete, move on to the next one */
+                if (hgot == FRAME_HDR && left == 0) {
+                    if (out) {
+                        fputs(EOL, out);
+                        if (out != stdout)
+                            fclose(out);
+                    }
+                    out = NULL;
+                    hgot = 0;
+                    unmap_request(r);
+                    for (++nrecv; nrecv < nsent && reqs[nrecv].failed; )
+                        ++nrecv;
+                    if (nrecv == nreqs)
+                        break;
+                }
+            }
+        }
+
+        /* push out as much of the next request as the socket will take */
+        if ((pfd.revents & POLLOUT) && nsent < nreqs) {
+            r = &reqs[nsent];
+
+            /* starting a new request: check a batch entry, then build
+               its header */
+            if (phase == 0 && hsent == 0) {
+                if (!r->ptdata && !check_request(r)) {
+                    unmap_request(r);
+                    r->failed = 1;
+                    ++refused;
+                    ++nsent;
+                    continue;
+                }
+
+                poff = koff = 0;
+                ptsrc = r->ptdata;
+                keysrc = r->keydata;
+                ptfd = r->ptfd;
+                keyfd = r->keyfd;
+                keybase = r->keymap ? r->keydata - r->keymap : 0;
+                sendlen = r->len;
+
+                if (packed) {
+                    ptfd = keyfd = -1;
+                    sendlen = otp_packed_size(r->len);
+                    free(packbuf);
+                    if (!(packbuf = malloc(2 * sendlen + 1))) {
+                        perror("otp_dec: could not allocate memory");
+                        broken = 1;
+                        continue;
+                    }
+
+                    otp_pack(packbuf, r->ptdata, r->len);
+                    ptsrc = (char *) packbuf;
+                    if (r->pad < 0) {
+                        otp_pack(packbuf + sendlen, r->keydata, r->len);
+                        keysrc = (char *) packbuf + sendlen;
+                    }
+                }
+
+                if (r->pad >= 0) {
+                    /* the key stays on the server */
+                    pack_header(shdr, FRAME_PAD_OP, r->len, r->padoff);
+                    shdr[1] = r->pad;
+                    koff = sendlen;
+                } else {
+                    /* only as much key as the message needs goes out */
+                    pack_header(shdr, FRAME_OP, r->len, r->len);
+                }
+            }
+
+            rwb = 1;
+            if (phase == 0) {
+                rwb = send(sockfd, shdr + hsent, FRAME_HDR - hsent,
+                        MSG_NOSIGNAL);
+                if (rwb > 0 && (hsent += rwb) == FRAME_HDR)
+                    phase = 1;
+            } else if (phase == 1 && poff < sendlen) {
+                rwb = send_range(sockfd, ptfd, 0, ptsrc, &poff,
+                        sendlen - poff);
+            } else if (koff < sendlen) {
+                rwb = send_range(sockfd, keyfd, keybase, keysrc, &koff,
+                        sendlen - koff);
+            }
+
+            if (rwb == 0 || (rwb < 0 && errno != EAGAIN && errno != EINTR)) {
+                broken = 1;
+                continue;
+            }
+
+            if (phase == 1 && poff == sendlen)
+                phase = 2;
+
+            /* all of this request is out */
+            if (phase == 2 && koff == sendlen) {
+                phase = 0;
+                hsent = 0;
+                ++nsent;
+            }
+        }
+    }
+
+    if (out && out != stdout)
+        fclose(out);
+    free(packbuf);
+
+    if (broken)
+        report_unanswered(reqs, nrecv, nsent, nreqs);
+    return broken ? -1 : refused;
+}
+
+
+/* Shared memory counterpart of pipeline(): copies the nreqs requests in
+ * reqs into a ring shared with the server, ringing its doorbell for
+ * each, and keeps up to window of them (BATCH_WINDOW for 0) in flight as
+ * long as the ring has room.  A batch entry is only checked and mapped
+ * as it is copied in, and unmapped straight after.  Each reply is written
+ * from the ring to the request's output, followed by a newline.  Returns
+ * the number of requests the server refused or that failed their checks,
+ * or -1 if the connection broke before every reply was in.
+ */
+int pipeline_shm(int sockfd, struct request *reqs, int nreqs, int window)
+{
+    unsigned char bell[SHM_DOORBELL];
+    uint64_t ringsz = SHM_RING, need, off, head, tail, len, padoff;
+    int nsent = 0, nrecv = 0, refused = 0, broken = 0, i;
+
+    /* where each request sits in the ring, and where it ends */
+    uint64_t *offs, *ends;
+
+    struct request *r;
+    struct stat st;
+    char *ring;
+    FILE *out;
+
+    /* the ring has to be able to hold the biggest request by itself; a
+       batch entry not yet checked may need as much again for its key */
+    for (i = 0; i != nreqs; ++i) {
+        if (reqs[i].ptdata)
+            need = reqs[i].len + ((reqs[i].pad >= 0) ? 0 : reqs[i].len);
+        else
+            need = (stat(reqs[i].ptfile, &st) == 0) ? 2 * st.st_size : 0;
+        if (need > ringsz)
+            ringsz = need;
+    }
+
+    /* doorbells are kept to a window so that neither side can fill the
+       socket with them while the other is stuck writing too */
+    if (window <= 0)
+        window = BATCH_WINDOW;
+
+    if (!(offs = malloc(2 * nreqs * sizeof(uint64_t))))
+        return -1;
+    ends = offs + nreqs;
+
+    if (!(ring = send_ring(sockfd, ringsz))) {
+        free(offs);
+        return -1;
+    }
+
+    while (!broken && nrecv < nreqs) {
+        /* put in as many requests as there is room and window for */
+        while (nsent < nreqs && nsent - nrecv < window) {
+            r = &reqs[nsent];
+
+            /* an entry that fails its checks takes no room, but where the
+               one before it stands, so the ring is read the same */
+            if (!r->ptdata && !check_request(r)) {
+                unmap_request(r);
+                r->failed = 1;
+                ++refused;
+                offs[nsent] = (nsent == nrecv) ? 0 : offs[nsent - 1];
+                ends[nsent] = (nsent == nrecv) ? 0 : ends[nsent - 1];
+                ++nsent;
+                continue;
+            }
+
+            /* every request takes up at least a byte, so offsets only go
+               down when the ring wraps around */
+            need = r->len + ((r->pad >= 0) ? 0 : r->len);
+            if (need == 0)
+                need = 1;
+
+            /* room right after the newest request, or failing that at the
+               start of the ring; ringsz means there is none yet */
+            if (nsent == nrecv) {
+                off = 0;
+            } else {
+                tail = offs[nrecv];
+                head = ends[nsent - 1];
+                if (offs[nsent - 1] >= tail)
+                    off = (ringsz - head >= need) ? head
+                        : (tail >= need) ? 0 : ringsz;
+                else
+                    off = (tail - head >= need) ? head : ringsz;
+            }
+            if (off == ringsz)
+                break;
+
+            memcpy(ring + off, r->ptdata, r->len);
+            if (r->pad >= 0) {
+                /* the key stays on the server */
+                pack_header(bell, FRAME_PAD_OP, r->len, r->padoff);
+                bell[1] = r->pad;
+            } else {
+                memcpy(ring + off + r->len, r->keydata, r->len);
+                pack_header(bell, FRAME_OP, r->len, r->len);
+            }
+            for (i = 0; i != 8; ++i)
+                bell[FRAME_HDR + i] = off >> (56 - 8 * i);
+
+            if (!write_full(sockfd, (char *) bell, sizeof(bell))) {
+                broken = 1;
+                break;
+            }
+
+            offs[nsent] = off;
+            ends[nsent] = off + need;
+            unmap_request(r);
+            ++nsent;
+        }
+
+        /* no reply is coming for an entry that was never sent */
+        while (!broken && nrecv < nsent && reqs[nrecv].failed)
+            ++nrecv;
+        if (!broken && nrecv == nsent)
+            continue;
+
+        /* then wait for the oldest one to be answered */
+        if (broken || !read_full(sockfd, (char *) bell, sizeof(bell))) {
+            broken = 1;
+            break;
+        }
+
+        r = &reqs[nrecv];
+        for (off = 0, i = 0; i != 8; ++i)
+            off = (off << 8) | bell[FRAME_HDR + i];
+
+        /* replies come in order, each where its request was put */
+        if (off != offs[nrecv]) {
+            broken = 1;
+            break;
+        }
+
+        if (unpack_header(bell, &len, &padoff) != FRAME_RESULT
+                || len != r->len) {
+            fprintf(stderr, "otp_dec: server refused the ");
+            fprintf(stderr, "request for %s\n", r->ptfile);
+            ++refused;
+        } else {
+            /* the offset is needed again to decrypt */
+            if (r->pad >= 0 && r->padoff == PAD_NEXT)
+                fprintf(stderr, "otp_dec: %s used pad @%d:%llu\n",
+                        r->ptfile, r->pad, (unsigned long long) padoff);
+
+            if (!r->outfile) {
+                out = stdout;
+            } else if (!(out = fopen(r->outfile, "w"))) {
+                fprintf(stderr, "otp_dec: could not write %s\n",
+                        r->outfile);
+                ++refused;
+            }
+
+            if (out) {
+                fwrite(ring + off, 1, len, out);
+                fputs(EOL, out);
+                if (out != stdout)
+                    fclose(out);
+            }
+        }
+
+        ++nrecv;
+    }
+
+    munmap(ring, ringsz);
+    free(offs);
+
+    if (broken)
+        report_unanswered(reqs, nrecv, nsent, nreqs);
+    return broken ? -1 : refused;
+}
+
+
+/* Reads exactly len bytes from sockfd into buf.  Returns 1 on success
+ * or 0 if the server hung up or the read failed first.
+ */
+int read_full(int sockfd, char *buf, size_t len)
 {
-    /* counters */
-    size_t rdb = 1, trdb = 0, rem = bufsz - 1;
+    ssize_t rdb;
+
+    while (len > 0) {
+        rdb = read(sockfd, buf, len);
 
-    /* pointer to next char in buffer to fill */
-    char *pos = buf;
+        if (rdb < 0 && errno == EINTR)
+            continue;
+        if (rdb <= 0)
+            return 0;
+
+        buf += rdb;
+        len -= rdb;
+    }
+
+    return 1;
+}
+
+
+/* Loads a batch manifest: one "plaintext key output" triple of paths per
+ * line, separated by whitespace.  Blank lines and lines starting with #
+ * are skipped.  Stores a newly allocated array of requests in *reqs and
+ * returns how many there are, or -1 if the manifest is unreadable or a
+ * line is malformed.
+ */
+int read_manifest(const char *fname, struct request **reqs)
+{
+    FILE *f;
+    char *line = NULL, *pt, *key, *out;
+    size_t linesz = 0;
+    int n = 0, max = 0, lineno = 0;
+    struct request *list = NULL, *grown;
+
+    if (!(f = fopen(fname, "r")))
+        return -1;
+
+    while (getline(&line, &linesz, f) != -1) {
+        ++lineno;
+        pt = strtok(line, " \t\n");
+        if (!pt || *pt == '#')
+            continue;
+
+        key = strtok(NULL, " \t\n");
+        out = strtok(NULL, " \t\n");
+        if (!key || !out || strtok(NULL, " \t\n")) {
+            fprintf(stderr, "otp_dec: %s line %d: expected ", fname, lineno);
+            fprintf(stderr, "plaintext key output\n");
+            n = -1;
+            break;
+        }
+
+        /* grow the list ten at a time like the daemon's child list */
+        if (n == max) {
+            max += 10;
+            if (!(grown = realloc(list, max * sizeof(struct request)))) {
+                n = -1;
+                break;
+            }
+            list = grown;
+        }
+
+        list[n].ptfile = strdup(pt);
+        list[n].keyfile = strdup(key);
+        list[n].outfile = strdup(out);
+        list[n].ptdata = list[n].keydata = list[n].keymap = NULL;
+        list[n].len = 0;
+        list[n].failed = 0;
+        ++n;
+    }
+
+    free(line);
+    fclose(f);
+
+    if (n < 0) {
+        free(list);
+        return -1;
+    }
+
+    *reqs = list;
+    return n;
+}
+
+
+/* Copies the decrypted message from the server on sockfd to out a chunk
+ * at a time as it arrives, until the server hangs up, so that it can be
+ * any length and is passed along before the last of it is in.  Returns 1
+ * if some message came and all of it was written, otherwise 0.
+ */
+int receive(int sockfd, FILE *out)
+{
+    char buffer[STREAM_CHUNK];
+    ssize_t rdb;
+    size_t trdb = 0;
 
-    memset(buf, 0, bufsz);
-    
     /* loop as long as data is forthcoming */
-    while (rdb) {
-        rdb = read(sockfd, pos, rem);
+    while ((rdb = read(sockfd, buffer, sizeof(buffer))) != 0) {
+        if (rdb < 0 && errno == EINTR)
+            continue;
+        if (rdb < 0)
+            return 0;
 
-        pos += rdb;
+        if (fwrite(buffer, 1, rdb, out) != (size_t) rdb || fflush(out) != 0)
+            return 0;
         trdb += rdb;
-        rem -= rdb;
     }
 
-    /* return the number of bytes read, > 0 is a success */
-    return (int) trdb;
+    /* an empty reply is as good as none */
+    return trdb > 0;
 }
 
 
-/* Sends the contents of the file rfile through sockfd to the server */
-int transmit(int sockfd, const char *rfile)
+/* Names each of the nreqs requests in reqs from nrecv on, which a
+ * broken connection left without a reply, saying whether it had all
+ * gone out (the first nsent had)
+ */
+void report_unanswered(const struct request *reqs, int nrecv, int nsent,
+        int nreqs)
 {
-    char buffer[SIZEBUF];
+    for (; nrecv < nreqs; ++nrecv)
+        fprintf(stderr, "otp_dec: no reply for %s, which was %s\n",
+                reqs[nrecv].ptfile, (nrecv < nsent) ? "sent" : "never sent");
+}
 
-    /* pointer to next character to send */
-    char *cur;
 
-    /* file to read in the data from */
-    FILE *rf;
+/* Spreads the nreqs requests in reqs over nconns framed connections to
+ * the server at addr, one forked child per connection, each keeping up
+ * to window requests in flight.  Replies go to each request's output
+ * file.  Returns 1 if every request was answered.
+ */
+int run_batch(struct request *reqs, int nreqs, const char *addr,
+        const char *sig, const char *resp_sig, size_t respsz, int nconns,
+        int window)
+{
+    pid_t *pids;
+    int i, first, count, sockfd, status, ok = 1;
 
-    /* counters */
-    size_t rdb, wrb;
+    if (nconns > nreqs)
+        nconns = nreqs;
+    if (nconns < 1)
+        return 1;
 
-    memset(buffer, 0, sizeof(buffer));
+    if (!(pids = malloc(nconns * sizeof(pid_t)))) {
+        perror("otp_dec: could not allocate memory");
+        return 0;
+    }
 
-    /* open the file and read everything */
-    rf = fopen(rfile, "r");
-    rdb = fread(buffer, sizeof(char), sizeof(buffer) - 1, rf);
+    for (i = 0; i != nconns; ++i) {
+        /* each connection takes its own contiguous slice */
+        first = (int) ((long) nreqs * i / nconns);
+        count = (int) ((long) nreqs * (i + 1) / nconns) - first;
 
-    /* too much information in file, gotta bail out */
-    if (!feof(rf)) {
-        fclose(rf);
-        return 0;
+        pids[i] = fork();
+
+        if (pids[i] < 0) {
+            fprintf(stderr, "otp_dec: failed to fork batch worker\n");
+            ok = 0;
+            break;
+        }
+
+        if (pids[i] == 0) {
+            /* each connection backs off on its own schedule */
+            srand(time(0) ^ getpid());
+
+            sockfd = connect_server(addr, sig, resp_sig, respsz, NULL, 0);
+
+            /* a server that can't be reached at all can be stood in for */
+            if (fallback && (sockfd == -1 || sockfd == -2)) {
+                fprintf(stderr, "otp_dec: could not reach server, ");
+                fprintf(stderr, "decrypting here\n");
+                exit(run_local(reqs + first, count) == 0
+                        ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+
+            if (sockfd < 0) {
+                fprintf(stderr, "otp_dec: %s\n", (sockfd == -4)
+                        ? "server too busy" : (sockfd == -3)
+                        ? "failed handshake with server"
+                        : "could not connect to server");
+                exit(EBADPORT);
+            }
+
+            status = shm ? pipeline_shm(sockfd, reqs + first, count, window)
+                : pipeline(sockfd, reqs + first, count, window);
+            close(sockfd);
+
+            if (status < 0)
+                fprintf(stderr, "otp_dec: could not read from socket\n");
+            exit(status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    /* the batch only succeeds if every slice did */
+    for (--i; i >= 0; --i) {
+        if (waitpid(pids[i], &status, 0) < 0
+                || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ok = 0;
+    }
+
+    free(pids);
+    return ok;
+}
+
+
+/* Transforms the nreqs requests in reqs right here with libotp, with no
+ * server involved, writing each result to the request's output followed
+ * by a newline just as pipeline() does.  Requests on the server's pads
+ * can't be done here.  Returns the number of requests that failed.
+ */
+int run_local(struct request *reqs, int nreqs)
+{
+    char buffer[STREAM_CHUNK];
+    struct request *r;
+    size_t off, n;
+    FILE *out;
+    int i, failed = 0;
+
+    for (i = 0; i != nreqs; ++i) {
+        r = &reqs[i];
+
+        /* a batch entry is checked, and mapped, only once its turn comes */
+        if (!r->ptdata && !check_request(r)) {
+            unmap_request(r);
+            ++failed;
+            continue;
+        }
+
+        if (r->pad >= 0) {
+            fprintf(stderr, "otp_dec: %s needs a server pad, which ",
+                    r->ptfile);
+            fprintf(stderr, "only the server has\n");
+            unmap_request(r);
+            ++failed;
+            continue;
+        }
+
+        if (!r->outfile) {
+            out = stdout;
+        } else if (!(out = fopen(r->outfile, "w"))) {
+            fprintf(stderr, "otp_dec: could not write %s\n", r->outfile);
+            unmap_request(r);
+            ++failed;
+            continue;
+        }
+
+        /* a chunk at a time, so any length takes the same memory */
+        for (off = 0; off < r->len; off += n) {
+            n = (r->len - off < sizeof(buffer)) ? r->len - off
+                : sizeof(buffer);
+            otp_transform(OTP_OP, buffer, n, r->ptdata + off,
+                    r->keydata + off);
+            fwrite(buffer, 1, n, out);
+        }
+        fputs(EOL, out);
+
+        if (ferror(out) || (out != stdout && fclose(out) != 0)) {
+            fprintf(stderr, "otp_dec: could not write %s\n",
+                    r->outfile ? r->outfile : "output");
+            ++failed;
+        }
+        unmap_request(r);
     }
-    fclose(rf);
 
-    /* loop through buffer until all data written to socket */
-    cur = buffer;
-    while (rdb > 0) {
-        wrb = write(sockfd, cur, rdb);
+    return failed;
+}
+
+
+/* Sends up to count bytes of data, from *off on, to sockfd and advances
+ * *off past them.  data is a mapping of the file fd from offset base:
+ * sendfile() moves the bytes from the page cache straight into the
+ * socket, and only without an fd, or for a file it can't handle, are
+ * they sent out of the mapping instead.  Returns the number of bytes
+ * sent, or -1 with errno set.
+ */
+ssize_t send_range(int sockfd, int fd, off_t base, const char *data,
+        size_t *off, size_t count)
+{
+    off_t pos = base + *off;
+    ssize_t wrb = -1;
+
+    if (fd >= 0)
+        wrb = sendfile(sockfd, fd, &pos, count);
+    if (fd < 0 || (wrb < 0 && (errno == EINVAL || errno == ENOSYS)))
+        wrb = send(sockfd, data + *off, count, MSG_NOSIGNAL);
+
+    if (wrb > 0)
+        *off += wrb;
+    return wrb;
+}
+
+
+/* Makes a ring of size bytes of shared memory and passes it to the
+ * server on sockfd, sealed so it can't shrink under the server's
+ * mapping.  Returns the ring, or NULL if it couldn't be made or sent.
+ */
+char *send_ring(int sockfd, uint64_t size)
+{
+    char byte = 0, ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    void *ring = MAP_FAILED;
+    int fd, ok;
+
+    if ((fd = memfd_create("otp_dec ring",
+                    MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+        return NULL;
+
+    if (ftruncate(fd, size) == 0
+            && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) == 0)
+        ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-        cur += wrb;
-        rdb -= wrb;
+    /* the descriptor goes along with a single byte of message */
+    memset(&mh, 0, sizeof(mh));
+    memset(ctl, 0, sizeof(ctl));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl;
+    mh.msg_controllen = sizeof(ctl);
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+    ok = ring != MAP_FAILED && sendmsg(sockfd, &mh, MSG_NOSIGNAL) == 1;
+    close(fd);
+
+    if (!ok && ring != MAP_FAILED)
+        munmap(ring, size);
+    return ok ? ring : NULL;
+}
+
+
+/* Sends the len bytes of data, which sits at offset base of the file fd,
+ * through sockfd to the server with send_range().  Returns 1 once all of
+ * it is out.
+ */
+int transmit(int sockfd, int fd, off_t base, const char *data,
+        size_t len)
+{
+    size_t off = 0;
+    ssize_t wrb;
+
+    while (off < len) {
+        wrb = send_range(sockfd, fd, base, data, &off, len - off);
+
+        if (wrb < 0 && errno == EINTR)
+            continue;
+        if (wrb <= 0)
+            return 0;
     }
-    
+
     return 1;
 }
 
 
-/* Verifies that the file contains only characters that can be handled
- * by the server's de-OTP function
+/* Streams the first len chars of r's message and key to the server in
+ * alternating chunks, writing the decrypted message to stdout as it
+ * comes back.  The socket is made non-blocking and sending and receiving
+ * are interleaved so neither side stalls on a full socket buffer; the
+ * files go out through send_range().  Returns 1 if the whole message
+ * made the round trip.
  */
-int validate_file(const char *fname)
+int transmit_stream(int sockfd, const struct request *r, size_t len)
 {
-    int ch;
-    
-    /* open the file and peruse the contents */
-    FILE *f = fopen(fname, "r");
+    /* message length line that goes out ahead of the data */
+    char lenbuf[24];
 
-    if (!f)
-        return -1;
+    /* whatever has come back so far */
+    char recvbuf[STREAM_CHUNK];
+
+    struct pollfd pfd;
+
+    /* counters: chunk is the size of the current message/key pair, of
+       which psent and ksent bytes have gone out */
+    size_t lenlen, lensent = 0, left = len, got = 0;
+    size_t chunk = 0, psent = 0, ksent = 0, poff = 0, koff = 0;
+    ssize_t rwb;
+    int ok = 1;
 
-    /* anything other than a capital letter, a space, or a newline
-       means the file is invalid */
-    while ((ch = fgetc(f)) != EOF) {
-        if (!((ch >= 'A' && ch <= 'Z') || ch == ' ' || ch == '\n'))
+    lenlen = snprintf(lenbuf, sizeof(lenbuf), "%zu\n", len);
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+    while (ok && (got < len || lensent < lenlen)) {
+        /* start the next pair of chunks once the last one is out */
+        if (ksent == chunk && left > 0) {
+            chunk = (left < STREAM_CHUNK) ? left : STREAM_CHUNK;
+            psent = ksent = 0;
+            left -= chunk;
+        }
+
+        pfd.fd = sockfd;
+        pfd.events = POLLIN;
+        if (lensent < lenlen || ksent < chunk)
+            pfd.events |= POLLOUT;
+
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno != EINTR)
+                ok = 0;
+            continue;
+        }
+
+        /* pass along any decrypted text that is ready */
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            rwb = read(sockfd, recvbuf, sizeof(recvbuf));
+            if (rwb > 0) {
+                fwrite(recvbuf, 1, rwb, stdout);
+                got += rwb;
+            } else if (rwb == 0 || (errno != EAGAIN && errno != EINTR)) {
+                ok = 0;
+                break;
+            }
+        }
+
+        /* push out as much as the socket will take: the length line,
+           then the message chunk, then the matching key chunk */
+        if (pfd.revents & POLLOUT) {
+            if (lensent < lenlen) {
+                rwb = send(sockfd, lenbuf + lensent, lenlen - lensent,
+                        MSG_NOSIGNAL);
+                if (rwb > 0)
+                    lensent += rwb;
+            } else if (psent < chunk) {
+                rwb = send_range(sockfd, r->ptfd, 0, r->ptdata, &poff,
+                        chunk - psent);
+                if (rwb > 0)
+                    psent += rwb;
+            } else {
+                rwb = send_range(sockfd, r->keyfd, r->keydata - r->keymap,
+                        r->keydata, &koff, chunk - ksent);
+                if (rwb > 0)
+                    ksent += rwb;
+            }
+
+            if (rwb == 0 || (rwb < 0 && errno != EAGAIN && errno != EINTR))
+                ok = 0;
+        }
+    }
+
+    return ok;
+}
+
+
+/* Fills in addr for the Unix domain socket at path, where a leading '@'
+ * names a socket in the abstract namespace.  Returns the length to pass
+ * along with addr, or 0 if the path is empty or too long.
+ */
+socklen_t unix_addr(struct sockaddr_un *addr, const char *path)
+{
+    size_t len = strlen(path);
+
+    if (len == 0 || len >= sizeof(addr->sun_path))
+        return 0;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len);
+
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + len;
+    }
+
+    return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+
+/* Lets go of the files a request was checked and sent from, once it is
+ * done with
+ */
+void unmap_request(struct request *r)
+{
+    if (r->ptdata && r->ptsize > 0)
+        munmap((void *) r->ptdata, r->ptsize);
+    if (r->keymap && r->keymapsz > 0)
+        munmap((void *) r->keymap, r->keymapsz);
+    if (r->ptfd >= 0)
+        close(r->ptfd);
+    if (r->keyfd >= 0)
+        close(r->keyfd);
+
+    r->ptdata = r->keydata = r->keymap = NULL;
+    r->ptfd = r->keyfd = -1;
+}
+
+
+/* Parses a FRAME_HDR-byte frame header, storing its two lengths, and
+ * returns its type
+ */
+int unpack_header(const unsigned char *hdr, uint64_t *len1, uint64_t *len2)
+{
+    int i;
+
+    *len1 = *len2 = 0;
+    for (i = 0; i != 8; ++i) {
+        *len1 = (*len1 << 8) | hdr[4 + i];
+        *len2 = (*len2 << 8) | hdr[12 + i];
+    }
+
+    return hdr[0];
+}
+
+
+/* Prints how to run this program and exits */
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-L | -S | -P | -M] [-f] plaintext key ",
+            prog);
+    fprintf(stderr, "port\n");
+    fprintf(stderr, "       %s [-P | -M] [-f] plaintext key ", prog);
+    fprintf(stderr, "[plaintext key ...] port\n");
+    fprintf(stderr, "       %s -l plaintext key [plaintext key ...] port\n",
+            prog);
+    fprintf(stderr, "       %s -b manifest [-P | -M] [-f | -l] ", prog);
+    fprintf(stderr, "[-c connections]\n           [-n in-flight] port\n");
+    fprintf(stderr, "-l does the work here instead of on the server, and ");
+    fprintf(stderr, "-f does so only if the\nserver can't be reached.\n");
+    fprintf(stderr, "port may also be the path of a Unix domain socket ");
+    fprintf(stderr, "(as -M needs), key a\nkey in an indexed pad file ");
+    fprintf(stderr, "as padfile:key, or one of the server's pads as\n");
+    fprintf(stderr, "@pad%s (with a key number for offset if the pad is ",
+            PAD_CLAIMS ? " or @pad:offset" : ":offset");
+    fprintf(stderr, "indexed)\n");
+    exit(EXIT_FAILURE);
+}
+
+
+/* Writes all len bytes of buf to sockfd.  Returns 1 on success or 0 if
+ * the server went away first.
+ */
+int write_full(int sockfd, const char *buf, size_t len)
+{
+    ssize_t wrb;
+
+    while (len > 0) {
+        wrb = write(sockfd, buf, len);
+
+        if (wrb < 0 && errno == EINTR)
+            continue;
+        if (wrb <= 0)
             return 0;
+
+        buf += wrb;
+        len -= wrb;
     }
 
-    /* otherwise the file is good */
-    fclose(f);
     return 1;
 }
 
 
+/* Writes the chars packed in the len bytes at in to out, *syms being
+ * how many are still to come in all.  Whole groups are unpacked in bulk;
+ * a group split between reads is held in grp, *ngrp bytes of it, until
+ * the rest arrives.  Returns 1 on success.
+ */
+int write_packed(FILE *out, const unsigned char *in, size_t len,
+        uint64_t *syms, unsigned char *grp, size_t *ngrp)
+{
+    char text[STREAM_CHUNK / 5 * 8 + 8];
+    size_t n, need, nsym;
+    int ok = 1;
+
+    while (ok && len > 0 && *syms > 0) {
+        n = (*syms / 8 < len / 5) ? *syms / 8 : len / 5;
+        if (n > sizeof(text) / 8)
+            n = sizeof(text) / 8;
+
+        if (*ngrp == 0 && n > 0) {
+            otp_unpack(text, in, 8 * n);
+            ok = fwrite(text, 1, 8 * n, out) == 8 * n;
+            in += 5 * n;
+            len -= 5 * n;
+            *syms -= 8 * n;
+            continue;
+        }
+
+        /* a group that has to be put together first, or the short last
+           one */
+        need = (*syms < 8) ? otp_packed_size(*syms) : 5;
+        n = (need - *ngrp < len) ? need - *ngrp : len;
+        memcpy(grp + *ngrp, in, n);
+        in += n;
+        len -= n;
+
+        if ((*ngrp += n) == need) {
+            nsym = (*syms < 8) ? *syms : 8;
+            otp_unpack(text, grp, nsym);
+            ok = fwrite(text, 1, nsym, out) == nsym;
+            *syms -= nsym;
+            *ngrp = 0;
+        }
+    }
+
+    return ok;
+}
+
+
 int main(int argc, char *argv[])
 {
-    int sockfd, portno, res;
-    struct sockaddr_in serv_addr;
-    struct stat st1, st2;
-    struct hostent *server;
-    int fd_pt, fd_key;
+    int sockfd, res, opt, npairs, i;
+    const char *addr;
+    size_t ptlen;
+    struct request *reqs;
 
     /* signatures for handshake with server */
-    char sig[] = "I am otp_dec";
+    char sig[64];
     char resp_sig[] = "I am otp_dec_d";
 
-    /* place to hold the message and key to send to server */
-    char buffer[SIZEBUF];
+    /* set by -L to use the original two-connection protocol */
+    int legacy = 0;
 
-    /* check for enough arguments */
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s plaintext key port\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
+    /* set by -S to stream the message through in chunks */
+    int stream = 0;
 
-    /* ensure that first file arg exists */
-    if (stat(argv[1], &st1) < 0) {
-        fprintf(stderr, "otp_dec: could not access file %s\n", argv[1]);
-        exit(EBADFILE);
+    /* set by -l to do the requests here, without the server */
+    int local = 0;
+
+    /* batch mode: manifest given with -b, connections with -c, and
+       requests in flight per connection with -n */
+    const char *manifest = NULL;
+    int nconns = 1;
+    int window = BATCH_WINDOW;
+
+    /* where the legacy protocol moves the data connection to */
+    char next[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+    /* check for options */
+    while ((opt = getopt(argc, argv, "LMPSb:c:fln:")) != -1) {
+        switch (opt) {
+            case 'b': {
+                manifest = optarg;
+                break;
+            }
+            case 'c': {
+                if ((nconns = atoi(optarg)) < 1) {
+                    fprintf(stderr, "otp_dec: need at least 1 connection\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'f': {
+                fallback = 1;
+                break;
+            }
+            case 'l': {
+                local = 1;
+                break;
+            }
+            case 'n': {
+                if ((window = atoi(optarg)) < 1) {
+                    fprintf(stderr, "otp_dec: need at least 1 request ");
+                    fprintf(stderr, "in flight\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'L': {
+                legacy = 1;
+                break;
+            }
+            case 'M': {
+                shm = 1;
+                break;
+            }
+            case 'P': {
+                packed = 1;
+                break;
+            }
+            case 'S': {
+                stream = 1;
+                break;
+            }
+            default: {
+                usage(argv[0]);
+            }
+        }
     }
 
-    /* ensure that second file arg exists */
-    if (stat(argv[2], &st2) < 0) {
-        fprintf(stderr, "otp_dec: could not access file %s\n", argv[2]);
-        exit(EBADFILE);
+    /* raw bytes can hold the newlines the legacy protocol ends things
+       with, and only a small alphabet packs into 5 bits */
+    if ((OTP_RAW && legacy) || (OTP_SYMS > 32 && packed)) {
+        fprintf(stderr, "otp_dec: -%c can't be used with this alphabet\n",
+                legacy ? 'L' : 'P');
+        exit(EXIT_FAILURE);
     }
 
-    /* ensure that key is at least as big as plaintext file */
-    if (st1.st_size > st2.st_size) {
-        fprintf(stderr, "otp_dec: key file smaller than plaintext file\n");
-        exit(EBADFILE);
+    /* files are checked with the fastest scan this CPU has */
+    otp_select(NULL);
+
+    /* sendfile() has no MSG_NOSIGNAL, so a server hanging up has to show
+       as a failed send rather than kill the client */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* the legacy signature is the plain one, without a protocol suffix,
+       and every one carries the alphabet's tag */
+    snprintf(sig, sizeof(sig), "I am otp_dec" OTP_TAG "%s",
+            legacy ? "" : stream ? STREAM_SUFFIX : packed ? PACKED_SUFFIX
+            : shm ? SHM_SUFFIX : FRAMED_SUFFIX);
+
+    /* a batch takes its pairs from the manifest and only the port from
+       the command line */
+    if (manifest) {
+        if (argc - optind != 1 || legacy || stream || (packed && shm)
+                || (local && (packed || shm || fallback)))
+            usage(argv[0]);
+
+        if ((npairs = read_manifest(manifest, &reqs)) < 0) {
+            fprintf(stderr, "otp_dec: could not read manifest %s\n",
+                    manifest);
+            exit(EBADFILE);
+        }
+
+        /* each entry is checked when its turn comes to be sent, so only
+           the files in flight are ever mapped at once */
+        addr = argv[optind];
+        if (parse_port(addr) < 0) {
+            fprintf(stderr, "otp_dec: received an invalid port number\n");
+            exit(EBADPORT);
+        }
+        if (shm && parse_port(addr) != 0) {
+            fprintf(stderr, "otp_dec: -M needs the server's Unix domain ");
+            fprintf(stderr, "socket\n");
+            exit(EBADPORT);
+        }
+
+        if (local)
+            return run_local(reqs, npairs) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+        res = run_batch(reqs, npairs, addr, sig, resp_sig,
+                sizeof(resp_sig), nconns, window);
+        return res ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    /* verify the characters present in the plaintext file */
-    if (validate_file(argv[1]) <= 0) {
-        fprintf(stderr, "otp_dec: plaintext file %s ", argv[1]);
-        fprintf(stderr, "contained invalid characters\n");
-        exit(EBADFILE);
+    /* check for enough arguments: one or more message/key pairs, then
+       the port; only the framed protocol can carry more than one pair */
+    npairs = (argc - optind - 1) / 2;
+    if (npairs < 1 || (argc - optind) % 2 != 1
+            || legacy + stream + packed + shm + local > 1
+            || (local && fallback) || ((legacy || stream) && npairs > 1))
+        usage(argv[0]);
+
+    /* check every pair before anything goes to the server */
+    if (!(reqs = malloc(npairs * sizeof(struct request)))) {
+        perror("otp_dec: could not allocate memory");
+        exit(EXIT_FAILURE);
     }
+    for (i = 0; i != npairs; ++i) {
+        reqs[i].ptfile = argv[optind + 2 * i];
+        reqs[i].keyfile = argv[optind + 2 * i + 1];
+        reqs[i].outfile = NULL;
+        reqs[i].failed = 0;
+        if (!check_request(&reqs[i]))
+            exit(EBADFILE);
+    }
+    ptlen = reqs[0].len;
 
-    /* verify the characters present in the key file */
-    if (validate_file(argv[2]) <= 0) {
-        fprintf(stderr, "otp_dec: key file %s ", argv[2]);
-        fprintf(stderr, "contained invalid characters\n");
-        exit(EBADFILE);
+    /* pads are only reachable with frames */
+    if ((legacy || stream) && reqs[0].pad >= 0) {
+        fprintf(stderr, "otp_dec: a server pad can't be used with -L or -S\n");
+        exit(EXIT_FAILURE);
     }
 
-    /* ensure that the port arg is valid */
-    portno = atoi(argv[3]);
-    if (portno < 1 || portno > 65535) {
+    /* ensure that the port arg is valid, unless it names a socket */
+    addr = argv[argc - 1];
+    if (parse_port(addr) < 0) {
         fprintf(stderr, "otp_dec: received an invalid port number\n");
         exit(EBADPORT);
     }
+    if (shm && parse_port(addr) != 0) {
+        fprintf(stderr, "otp_dec: -M needs the server's Unix domain ");
+        fprintf(stderr, "socket\n");
+        exit(EBADPORT);
+    }
 
-    /* get information about this host */
-    if ((server = gethostbyname("localhost")) == NULL) {
-        fprintf(stderr, "otp_dec: could not connect to localhost\n");
-        exit(EXIT_FAILURE);
+    /* the transform is cheap next to reaching a server for it */
+    if (local) {
+        res = run_local(reqs, npairs);
+        free(reqs);
+        return (res == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    /* try to open a socket to connect with server on */
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("otp_dec: could not open socket\n");
-        exit(EXIT_FAILURE);
+    /* attempt to connect to the server and exchange signatures with it,
+       waiting for room if it is busy; in legacy mode, if all goes well
+       get the address to connect on for data exchange */
+    srand(time(0) ^ getpid());
+    sockfd = connect_server(addr, sig, resp_sig, sizeof(resp_sig),
+            legacy ? next : NULL, sizeof(next));
+
+    /* a server that can't be reached at all can be stood in for */
+    if (fallback && (sockfd == -1 || sockfd == -2)) {
+        fprintf(stderr, "otp_dec: could not reach server, decrypting here\n");
+        res = run_local(reqs, npairs);
+        free(reqs);
+        return (res == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    memcpy(server->h_addr, &serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(portno);
+    switch (sockfd) {
+        case -1: {
+            perror("otp_dec: could not open socket\n");
+            exit(EXIT_FAILURE);
+        }
+        case -2: {
+            fprintf(stderr, "otp_dec: could not connect to server\n");
+            exit(EBADPORT);
+        }
+        case -3: {
+            fprintf(stderr, "otp_dec: failed handshake with server\n");
+            exit(EBADPORT);
+        }
+        case -4: {
+            fprintf(stderr, "otp_dec: server too busy; gave up after ");
+            fprintf(stderr, "%d tries\n", BUSY_TRIES);
+            exit(EBADPORT);
+        }
+        default:
+            break;
+    }
 
-    /* attempt to connect to the server */
-    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        fprintf(stderr, "otp_dec: could not connect to server\n");
+    /* close the old socket and open up a new one connected to the
+       server on the address received */
+    if (legacy) {
         close(sockfd);
-        exit(EBADPORT);
+
+        if ((sockfd = connect_addr(next)) < 0) {
+            fprintf(stderr, "otp_dec: could not connect to server ");
+            fprintf(stderr, "after successful handshake\n");
+            exit(EBADPORT);
+        }
     }
 
-    /* attempt a signature exchange with server, if all goes well get
-       the port number to connect on for data exchange */
-    if ((portno = handshake(sockfd, sig, sizeof(sig),
-                    resp_sig, sizeof(resp_sig))) <= 0) {
-        fprintf(stderr, "otp_dec: failed handshake with server\n");
+    /* in streaming mode the reply is printed as it arrives */
+    if (stream) {
+        res = transmit_stream(sockfd, &reqs[0], ptlen);
         close(sockfd);
-        exit(EBADPORT);
-    }
 
-    /* close the old socket and open up a new one connected to the
-       server on the port received */
-    close(sockfd);
-    server = gethostbyname("localhost");
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    memset(&serv_addr, 0, sizeof(serv_addr));
+        if (!res) {
+            fprintf(stderr, "\notp_dec: could not read from socket\n");
+            exit(EXIT_FAILURE);
+        }
 
-    serv_addr.sin_family = AF_INET;
-    memcpy(server->h_addr, &serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(portno);
+        printf("%s", EOL);
+        return EXIT_SUCCESS;
+    }
 
-   if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        fprintf(stderr, "otp_dec: could not connect to server ");
-        fprintf(stderr, "after successful handshake\n");
+    /* otherwise, unless asked for the old protocol, send all the
+       requests down the one connection and print each reply in turn */
+    if (!legacy) {
+        res = shm ? pipeline_shm(sockfd, reqs, npairs, 0)
+            : pipeline(sockfd, reqs, npairs, 0);
         close(sockfd);
-        exit(EBADPORT);
+        free(reqs);
+
+        if (res < 0) {
+            fprintf(stderr, "otp_dec: could not read from socket\n");
+            exit(EXIT_FAILURE);
+        }
+
+        return (res == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
     /* write plaintext to socket */
-    transmit(sockfd, argv[1]);
+    transmit(sockfd, reqs[0].ptfd, 0, reqs[0].ptdata, reqs[0].ptsize);
 
-    /* write key to socket */
-    transmit(sockfd, argv[2]);
+    /* write as much of the key as the server reads; it hangs up once it
+       has that, and anything more would be written to a closed socket */
+    transmit(sockfd, reqs[0].keyfd, reqs[0].keydata - reqs[0].keymap,
+            reqs[0].keydata, ptlen);
 
-    /* read decrypted response from socket */
-    res = receive(sockfd, buffer, sizeof(buffer) - 1);
+    /* print the decrypted response as it comes off the socket */
+    res = receive(sockfd, stdout);
     close(sockfd);
 
     /* if the server sent no response, we're in trouble */
     if (res == 0) {
-        fprintf(stderr, "otp_dec: could not read from socket\n");
+        fprintf(stderr, "\notp_dec: could not read from socket\n");
         exit(EXIT_FAILURE);
     }
 
-    /* otherwise print the decrypted message */
-    printf("%s\n", buffer);
+    printf("\n");
     return EXIT_SUCCESS;
 }
@@ -3,32 +3,452 @@
  * Course: CS 344
  */
 
+/* for file seals on the shared memory ring */
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-/* general purpose byte buffer size - huge to handle large transmissions */
-#define SIZEBUF 200000
+#include "otp.h"
 
-/* maximum allowed accepted connections on server socket */
-#define MAX_CON 20
+/* the io_uring backend needs the kernel's header, but not liburing */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
 
+/* general purpose byte buffer size - huge to handle large transmissions */
+#define SIZEBUF 200000
 
+/* length of the queue of connections waiting to be accepted, unless
+   -q says otherwise; anything past it is left for the client's kernel
+   to retry */
+#define MAX_CON 128
+
+/* clients served at once, unless -m says otherwise.  Past that, a new
+   client is told BUSY_SIG and how many milliseconds to wait before
+   trying again, in place of the daemon's signature, and hung up on. */
+#define MAX_INFLIGHT 256
+#define BUSY_SIG "I am busy"
+#define BUSY_RETRY_MS 100
+
+/* deadlines in milliseconds, unless -d says otherwise (0 turns one
+   off): to get through the handshake, to wait on a client that has gone
+   quiet mid-conversation, and to read, transform and answer a whole
+   request.  A client that misses one is hung up on and counted. */
+#define HANDSHAKE_MS 5000
+#define IDLE_MS 30000
+#define REQUEST_MS 300000
+
+/* the deadlines, as indexes into metrics.timeouts */
+#define T_HANDSHAKE 0
+#define T_IDLE 1
+#define T_REQUEST 2
+#define NUM_DEADLINES 3
+
+/* upper limit on the number of pre-forked workers accepted with -w */
+#define MAX_WORKERS 1024
+
+/* upper limit on the number of listener threads accepted with -t */
+#define MAX_THREADS 1024
+
+/* protocols a client can ask for by suffixing its handshake signature */
+#define PROTO_TIMEOUT -2    /* no signature within handshake_ms */
+#define PROTO_BUSY -1       /* turned away: too many clients already */
+#define PROTO_NONE 0        /* handshake failed */
+#define PROTO_PORT 1        /* data exchanged on a newly proposed port */
+#define PROTO_SINGLE 2      /* data exchanged on the handshake connection */
+#define PROTO_STREAM 3      /* like single, but in interleaved chunks */
+#define PROTO_FRAMED 4      /* persistent, length-prefixed frames */
+#define PROTO_PACKED 5      /* like framed, but 5 bits a symbol */
+#define PROTO_SHM 6         /* framed doorbells on a shared memory ring */
+#define NUM_PROTO 7
+
+/* signature suffixes, indexed by protocol */
+const char *proto_suffix[NUM_PROTO] = {
+    NULL, "", " single", " stream", " framed", " packed", " shm"
+};
+
+/* bytes of message (and of key) per chunk in the streaming protocol */
+#define STREAM_CHUNK 65536
+
+/* framed protocol: every frame starts with a header of one type byte,
+   three reserved bytes, and two 64-bit big-endian lengths.  Requests
+   carry the message and key lengths, replies the result length. */
+#define FRAME_HDR 20
+#define OP_ENCRYPT 'E'      /* request: message and key follow */
+#define OP_DECRYPT 'D'
+#define FRAME_RESULT 'R'    /* reply: transformed message follows */
+#define FRAME_ERROR 'X'     /* reply: request refused, nothing follows */
+
+/* the request type this daemon serves, and the direction libotp is
+   asked to take it in */
+#define FRAME_OP OP_ENCRYPT
+#define OTP_OP OTP_ENCRYPT
+
+/* the packed protocol frames requests the same way, lengths still
+   counting chars, but every message, key and result goes over the wire
+   5 bits a char: each as its place in the alphabet (A-Z as 0-25 and
+   space as 26 by default), char i at bit 5i of a little-endian bit
+   stream, so 8 chars take 5 bytes.  It is only offered for alphabets of
+   32 chars or fewer. */
+
+/* the shared memory protocol is for clients on the same host, over a
+   Unix domain socket.  Right after the handshake the client passes a
+   memfd, sealed against shrinking, as one byte of SCM_RIGHTS message;
+   both sides map it as a ring.  A request is then a SHM_DOORBELL-byte
+   doorbell: a frame header as above, and the 64-bit big-endian offset
+   into the ring of the message, with its key right behind it (pad
+   requests have no key there).  The result is written over the message
+   and announced by a doorbell back, FRAME_RESULT or FRAME_ERROR, with
+   the same offset.  Only doorbells go through the socket. */
+#define SHM_DOORBELL (FRAME_HDR + 8)
+
+/* largest message accepted in one frame; use streaming beyond this */
+#define FRAME_MAX (1ULL << 30)
+
+/* pad requests carry no key: the second header byte names one of the
+   pads loaded with -p, len1 is the message length, and len2 the offset
+   into the pad to take the key from, or PAD_NEXT to be handed the next
+   unused stretch.  The result frame's len2 says which offset was used. */
+#define OP_ENCRYPT_PAD 'e'  /* request: message follows */
+#define OP_DECRYPT_PAD 'd'
+#define PAD_NEXT UINT64_MAX
+
+/* the pad request type this daemon serves, and whether it may pick the
+   offset (only encryption should ever use fresh pad).  The daemon that
+   picks also claims every offset it is given, so its pad is never used
+   twice; the other may go back to any of it. */
+#define FRAME_PAD_OP OP_ENCRYPT_PAD
+#define PAD_CLAIMS 1
+
+/* most pads loaded with -p */
+#define MAX_PADS 16
+
+/* an indexed pad from keygen -n starts with a PADHDR-byte header of
+   PADMAGIC and the little-endian key count, followed by count + 1
+   little-endian file offsets: key i starts at the i-th and ends with a
+   newline just before the next.  Requests on such a pad give a key
+   number in place of an offset, and each key serves one message. */
+#define PADMAGIC "OTPKEYS\n"
+#define PADHDR 16
+
+/* prefix for every metric name in the exposition */
+#define METRIC_PREFIX "otp_enc_d"
+
+/* latency histogram bucket upper bounds, in microseconds; one more
+   bucket past the end catches everything slower */
+#define NUM_BUCKETS 16
+const double bucket_us[NUM_BUCKETS] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000
+};
+
+/* counters kept in memory shared by the daemon and all its children, so
+   they survive the processes that update them */
+struct metrics {
+    unsigned long connections;          /* clients accepted */
+    unsigned long handshake_failures;   /* clients with a bad signature */
+    unsigned long busy;                 /* clients turned away as busy */
+    unsigned long timeouts[NUM_DEADLINES];  /* clients hung up on for
+                                               missing a deadline */
+    unsigned long requests;             /* requests answered */
+    unsigned long request_errors;       /* requests refused or cut short */
+    unsigned long bytes_in;             /* message and key bytes read */
+    unsigned long bytes_out;            /* result bytes written */
+    long active;                        /* clients being served right now;
+                                           admit() keeps it at or under
+                                           max_inflight */
+    long pool_size;                     /* pre-forked workers, 0 if none */
+    long threads;                       /* listener threads, 0 if none */
+    unsigned long request_hist[NUM_BUCKETS + 1];
+    unsigned long request_sum_ns;
+    unsigned long encode_hist[NUM_BUCKETS + 1];
+    unsigned long encode_sum_ns;
+};
+
+#ifdef HAVE_IO_URING
+/* io_uring backend: each process runs one event loop for all its
+   framed clients, reading requests into a pool of registered buffers */
+#define URING_ENTRIES 8192      /* submission queue entries */
+#define URING_CONNS 4000        /* most connections open at once */
+#define URING_SLOTS 256         /* registered request buffers */
+#define URING_SLOT 16384        /* bytes in each registered buffer */
+
+/* where a connection is in its conversation with the event loop */
+#define U_HANDSHAKE 0           /* reading the client's signature */
+#define U_GREET 1               /* sending the daemon's signature */
+#define U_HEADER 2              /* reading a request header */
+#define U_BODY 3                /* reading the message and key */
+#define U_REPLY 4               /* sending a result */
+#define U_REFUSE 5              /* sending an error, then hanging up */
+#define U_SKIP 6                /* reading off a refused request's body */
+#define U_ERROR 7               /* sending an error for a refused request */
+
+/* user_data of the timeouts linked to transfers; their own completions
+   say nothing the transfer's don't, so they are skipped */
+#define U_TIMER 1UL
+
+/* a ring set up by uring_setup(), and the buffers registered with it */
+struct uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned tail;              /* submission tail, ahead of the kernel's */
+    unsigned pending;           /* entries queued since the last submit */
+    char *slots;                /* URING_SLOTS buffers, NULL if none */
+    int free_slots[URING_SLOTS];
+    int nfree;
+    int nconns;                 /* connections open */
+    int accepting;              /* an accept is queued */
+};
+
+/* one client connection served by the event loop; at most one transfer
+   is queued for it at a time */
+struct uconn {
+    int fd;
+    int state;
+    int slot;                   /* registered buffer in use, or -1 */
+    char hs[64];                /* client signature */
+    unsigned char hdr[FRAME_HDR];
+    char *buf;                  /* request in and reply out, or NULL */
+    char *io;                   /* start of the current transfer */
+    size_t len, done;           /* its size and how far it has got */
+    uint64_t msglen, keylen;
+    uint64_t wire;              /* bytes of request body on the wire */
+    uint64_t skip;              /* bytes of a refused body still to read */
+    int packed;                 /* speaks the packed protocol */
+    const char *padkey;         /* key for a pad request, else NULL */
+    uint64_t padoff;
+    double started;
+    int admitted;               /* holds a place from admit() */
+    double deadline;            /* end of the request under way, or 0 */
+    double expires;             /* when the queued transfer times out,
+                                   or 0 if it never does */
+    int limit;                  /* the deadline that would be missed */
+    struct __kernel_timespec ts;
+};
+#endif
+
+/* a keygen pad mapped into memory, shared by every worker */
+struct pad {
+    const char *name;
+    const char *data;       /* pad chars, without the trailing newline;
+                               for an indexed pad, the whole file */
+    uint64_t len;
+    const uint64_t *index;  /* an indexed pad's key offsets, else NULL */
+    uint64_t nkeys;
+    uint64_t *next;         /* first offset (or key) not yet handed out;
+                               mapped from name.off so it outlives the
+                               daemon, or NULL if PAD_CLAIMS is 0 */
+};
+
+/* what a listener thread from -t needs to serve its clients */
+struct listener {
+    int sockfd;             /* its own listening socket, where it can have
+                               one */
+    const char *sig, *resp_sig;
+    size_t respsz;
+};
+
+
+int accept_data(int datasockfd);
+int admit(void);
 int bg_check(pid_t **bg_pids, int *num_bg, int max_bg);
+void check_dump(void);
+const char *claim_pad(int padno, uint64_t *off, uint64_t len);
 void encode(char *encoded, size_t len, char *buffer, char *key);
+void encode_packed(unsigned char *out, size_t n, const unsigned char *msg,
+        const unsigned char *key);
 int handshake(int sockfd, const char *sig,
         const char *resp_sig, size_t respsz);
-int listen_port(int p);
+void init_metrics(void);
+int listen_addr(const char *addr, int shared);
+int listen_port(int p, int shared);
+int listen_unix(const char *path);
+void *listener_thread(void *arg);
+int load_pad(const char *fname);
+char *map_ring(int sockfd, uint64_t *size);
+double now(void);
+void observe(unsigned long *hist, unsigned long *sum_ns, double started);
+void on_child(int sig);
+void on_dump(int sig);
+void on_stop(int sig);
+void pack_header(unsigned char *hdr, int type, uint64_t len1, uint64_t len2);
+int pad_fits(const struct pad *p, uint64_t off, uint64_t len);
 int process(int sockfd);
+int process_framed(int sockfd, int packed);
+int process_pad(int sockfd, const unsigned char *hdr, double started,
+        int packed);
+int process_shm(int sockfd, char *ring, uint64_t ringsz);
+int process_stream(int sockfd);
+int parse_port(const char *addr);
+int parse_signature(const char *buffer, const char *sig);
+int past_deadline(void);
 int propose_port(int sockfd, int oldportno);
+int read_full(int sockfd, char *buf, size_t len);
+ssize_t read_some(int sockfd, char *buf, size_t len);
+void record_request(int ok, unsigned long in, unsigned long out,
+        double started);
+void refuse(int sockfd);
+int refuse_frame(int sockfd, uint64_t skip, double started);
+void release(void);
+int run_pool(int servsockfd, int nworkers, const char *sig,
+        const char *resp_sig, size_t respsz);
+int run_threads(const char *addr, int servsockfd, int nthreads,
+        const char *sig, const char *resp_sig, size_t respsz);
+void send_busy(int sockfd);
+int serve_client(int consockfd, const char *sig,
+        const char *resp_sig, size_t respsz);
+int serve_data(int sockfd, int proto);
+int serve_proto(int consockfd, int proto);
+void set_timeouts(int sockfd, long ms);
+pid_t spawn_admin(int adminport);
+pid_t spawn_worker(int servsockfd, long *slot, const char *sig,
+        const char *resp_sig, size_t respsz);
+void start_deadline(void);
+void stat_add(unsigned long *counter, long n);
+socklen_t unix_addr(struct sockaddr_un *addr, const char *path);
+int unpack_header(const unsigned char *hdr, uint64_t *len1, uint64_t *len2);
+#ifdef HAVE_IO_URING
+void uring_advance(struct uring *r, struct uconn *c, const char *sig,
+        const char *resp_sig, size_t respsz);
+int uring_buffer(struct uring *r, struct uconn *c);
+void uring_close(struct uring *r, struct uconn *c);
+void uring_handoff(struct uring *r, struct uconn *c, int proto,
+        const char *resp_sig, size_t respsz);
+void uring_open(struct uring *r, int fd);
+void uring_refuse(struct uring *r, struct uconn *c);
+void uring_release(struct uring *r, struct uconn *c);
+void uring_reply(struct uring *r, struct uconn *c);
+int uring_setup(struct uring *r, unsigned entries);
+struct io_uring_sqe *uring_sqe(struct uring *r);
+void uring_transfer(struct uring *r, struct uconn *c, int state, char *io,
+        size_t len);
+#endif
+int uring_available(void);
+void uring_loop(int servsockfd, const char *sig,
+        const char *resp_sig, size_t respsz);
+void worker_loop(int servsockfd, const char *sig,
+        const char *resp_sig, size_t respsz);
+int write_full(int sockfd, const char *buf, size_t len);
+int write_metrics(int fd);
+
+/* shared counters, set up by init_metrics() before anything is forked */
+struct metrics *stats;
+
+/* set by SIGUSR1 to have the parent dump the metrics to stderr */
+volatile sig_atomic_t dump_requested = 0;
+
+/* set by SIGTERM or SIGINT in a pool's parent, to take the pool down */
+volatile sig_atomic_t stop_requested = 0;
+
+/* the metrics process started for -a, or 0 */
+pid_t admin_pid = 0;
+
+/* where a pool worker counts the places admit() has given it, so the
+   pool's parent can take them back if the worker dies holding them */
+long *held = NULL;
+
+/* set in a child forked for a client its parent has already admitted */
+int preadmitted = 0;
+
+/* set by -u to serve clients from io_uring event loops */
+int use_uring = 0;
+
+/* accept queue length set by -q, and most clients served at once by -m */
+int backlog = MAX_CON;
+long max_inflight = MAX_INFLIGHT;
+
+/* deadlines set by -d, in milliseconds */
+long handshake_ms = HANDSHAKE_MS;
+long idle_ms = IDLE_MS;
+long request_ms = REQUEST_MS;
+
+/* when the request this thread is serving has to be done by, as a now()
+   time, or 0 between requests */
+__thread double deadline = 0;
+
+/* pads loaded with -p, numbered in the order given */
+struct pad pads[MAX_PADS];
+int npads = 0;
+
+
+/* Waits up to handshake_ms for the client to connect to the data socket
+ * proposed to it, which is closed either way.  Returns the client's
+ * connection, or -1 if it never came.
+ */
+int accept_data(int datasockfd)
+{
+    struct pollfd pfd = { datasockfd, POLLIN, 0 };
+    int accsockfd = -1, n;
+
+    while ((n = poll(&pfd, 1, handshake_ms ? handshake_ms : -1)) < 0
+            && errno == EINTR)
+        ;
+
+    if (n == 0)
+        stat_add(&stats->timeouts[T_HANDSHAKE], 1);
+    else if (n > 0 && (accsockfd = accept(datasockfd, NULL, NULL)) >= 0)
+        set_timeouts(accsockfd, idle_ms);
+
+    close(datasockfd);
+    return accsockfd;
+}
+
+
+/* Lets one more client be served, unless max_inflight already are.  The
+ * count is shared, so the limit holds across every worker.  Returns 1 if
+ * the client is in, or counts it as turned away and returns 0.
+ */
+int admit(void)
+{
+    long n = __atomic_load_n(&stats->active, __ATOMIC_RELAXED);
+
+    do {
+        if (n >= max_inflight) {
+            stat_add(&stats->busy, 1);
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&stats->active, &n, n + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (held)
+        stat_add((unsigned long *) held, 1);
+    return 1;
+}
 
 
 /* Checks on each background process started by shell and possibly
- * still running.  Processes still running are stored in *bg_pids.
+ * still running.  Processes still running are stored in *bg_pids.  Each
+ * child was admitted before it was forked, so its place is given back
+ * here once it is reaped, however it went.
  */
 int bg_check(pid_t **bg_pids, int *num_bg, int max_bg)
 {
@@ -53,6 +473,8 @@ int bg_check(pid_t **bg_pids, int *num_bg, int max_bg)
            running background processes */
         if (cur_pid <= 0)
             running_pids[j++] = (*bg_pids)[i];
+        else
+            release();
     }
 
     *num_bg = j;
@@ -62,61 +484,180 @@ int bg_check(pid_t **bg_pids, int *num_bg, int max_bg)
 }
 
 
+/* Dumps the metrics to stderr if SIGUSR1 asked for it since the last
+ * check
+ */
+void check_dump(void)
+{
+    if (dump_requested) {
+        dump_requested = 0;
+        write_metrics(STDERR_FILENO);
+    }
+}
+
+
+/* Finds the len chars of key for a pad request on pad padno at offset
+ * *off, or for an indexed pad, in key number *off.  A daemon that may
+ * pick claims the pad it hands out: if *off is PAD_NEXT, the next unused
+ * stretch of the pad or unused key is claimed and its offset or number
+ * stored in *off, and an offset given by the client is only accepted
+ * at or past every earlier claim, and claimed along with the pad it
+ * skips.  Claims are atomic, so no two requests in any worker ever get
+ * the same pad.  Returns the key, or NULL if there is no such pad, it
+ * can't cover the request, or the stretch asked for was already used.
+ */
+const char *claim_pad(int padno, uint64_t *off, uint64_t len)
+{
+    struct pad *p;
+    uint64_t want = *off, mark;
+
+    if (padno >= npads)
+        return NULL;
+    p = &pads[padno];
+
+    /* move the shared mark past the claim, unless someone else moved it
+       first, in which case try again from where they left it; a claim
+       that doesn't fit leaves the rest of the pad for smaller ones */
+    if (PAD_CLAIMS) {
+        mark = __atomic_load_n(p->next, __ATOMIC_RELAXED);
+        do {
+            *off = (want == PAD_NEXT) ? mark : want;
+            if (*off < mark || !pad_fits(p, *off, len))
+                return NULL;
+        } while (!__atomic_compare_exchange_n(p->next, &mark,
+                    *off + (p->index ? 1 : len), 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    } else if (want == PAD_NEXT) {
+        return NULL;
+    }
+
+    if (!pad_fits(p, *off, len))
+        return NULL;
+
+    /* an indexed pad's key is found without looking at any other */
+    if (p->index)
+        return p->data + le64toh(p->index[*off]);
+    return p->data + *off;
+}
+
+
 /* Given a buffer containing a string and a randomized key,
  * applies the OTP transformation and stores resulting first
  * len chars in encoded
  */
 void encode(char *encoded, size_t len, char *buffer, char *key)
 {
-    int i;
-    char ch;
-    char b, k;
+    double started = now();
 
-    /* for the first len chars, get the new char from the
-       buffer and key and store it */
-    for (i = 0; i < len; ++i) {
-        b = buffer[i];
-        k = key[i];
-        b = (b != ' ') ? b - 'A' : 26;
-        k = (k != ' ') ? k - 'A' : 26;
-        ch = (b + k) % 27;
-        ch = (ch != 26) ? ch + 'A' : ' ';
-        encoded[i] = ch;
-    }
+    otp_transform(OTP_OP, encoded, len, buffer, key);
+    observe(stats->encode_hist, &stats->encode_sum_ns, started);
 
     /* null-terminate */
-    encoded[i] = 0;
+    encoded[len] = 0;
+}
+
+
+/* Packed counterpart of encode(): transforms the n symbols packed in msg
+ * with those packed in key, packing the result into out, which may be
+ * msg
+ */
+void encode_packed(unsigned char *out, size_t n, const unsigned char *msg,
+        const unsigned char *key)
+{
+    double started = now();
+
+    otp_transform_packed(OTP_OP, out, n, msg, key);
+    observe(stats->encode_hist, &stats->encode_sum_ns, started);
 }
 
 
 /* Verifies that the client accepted on socket sockfd can supply
- * a matching signature
+ * a matching signature and returns the protocol named by the
+ * signature's suffix, or PROTO_NONE if it does not match.  A client with
+ * a good signature is only answered with the server's own once admit()
+ * lets it in; otherwise it is told to come back later and PROTO_BUSY is
+ * returned.
  */
 int handshake(int sockfd, const char *sig,
         const char *resp_sig, size_t respsz)
 {
     /* set up the buffer to hold signature sent from client */
     char buffer[SIZEBUF];
+    ssize_t n;
+    int proto;
+
     memset(buffer, 0, sizeof(buffer));
 
-    /* get the signature and store in buffer */
-    read(sockfd, buffer, sizeof(buffer) - 1);
+    /* get the signature and store in buffer; a child finishing in the
+       meantime must not cut the read short, but a client that says
+       nothing for handshake_ms loses its turn */
+    set_timeouts(sockfd, handshake_ms);
+    while ((n = read(sockfd, buffer, sizeof(buffer) - 1)) < 0
+            && errno == EINTR)
+        ;
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        stat_add(&stats->timeouts[T_HANDSHAKE], 1);
+        return PROTO_TIMEOUT;
+    }
+
+    /* if it names a known protocol and there is room, send back the
+       server's own signature */
+    if ((proto = parse_signature(buffer, sig)) == PROTO_NONE)
+        return proto;
 
-    /* if signature matches what was expected, send back the server's
-       own signature */
-    if (strcmp(sig, buffer) == 0) {
-        write(sockfd, resp_sig, respsz - 1);
-        return 1;
+    if (!preadmitted && !admit()) {
+        send_busy(sockfd);
+        return PROTO_BUSY;
     }
 
-    return 0;
+    write(sockfd, resp_sig, respsz - 1);
+    set_timeouts(sockfd, idle_ms);
+    return proto;
+}
+
+
+/* Sets up the shared metrics before any child is forked.  If no shared
+ * memory can be had the counters still work, but only for this process.
+ */
+void init_metrics(void)
+{
+    static struct metrics local;
+
+    stats = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (stats == MAP_FAILED) {
+        perror("otp_enc_d: could not map shared metrics");
+        stats = &local;
+    }
+
+    memset(stats, 0, sizeof(struct metrics));
+}
+
+
+/* Listens on addr: a TCP port if it is all digits, otherwise the path of
+ * a Unix domain socket.  Returns the socket or a negative error as
+ * listen_port() does; shared is passed on to it.
+ */
+int listen_addr(const char *addr, int shared)
+{
+    int p = parse_port(addr);
+
+    if (p < 0)
+        return -2;
+
+    return p ? listen_port(p, shared) : listen_unix(addr);
 }
 
 
-/* Creates, binds to, and listens on a new socket on port p */
-int listen_port(int p)
+/* Creates, binds to, and listens on a new socket on port p.  If shared,
+ * the port may already have other listening sockets of ours on it, and
+ * the kernel spreads new connections between them.
+ */
+int listen_port(int p, int shared)
 {
-    int sockfd;
+    int sockfd, one = 1;
     struct sockaddr_in serv_addr;
 
     /* try to get a socket file descriptor */
@@ -124,6 +665,15 @@ int listen_port(int p)
         return -1;
     }
 
+    /* a restarted daemon should not have to wait out its old
+       connections in TIME_WAIT to get the port back */
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (shared && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one,
+                sizeof(one)) < 0) {
+        close(sockfd);
+        return -2;
+    }
+
     /* try to bind the socket to a specific port and allow all traffic */
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
@@ -131,11 +681,13 @@ int listen_port(int p)
     serv_addr.sin_port = htons(p);
     if (bind(sockfd, (struct sockaddr *) &serv_addr,
                 sizeof(serv_addr)) < 0) {
+        close(sockfd);
         return -2;
     }
 
     /* try to listen on the socket */
-    if (listen(sockfd, p) < 0) {
+    if (listen(sockfd, backlog) < 0) {
+        close(sockfd);
         return -3;
     }
 
@@ -144,6 +696,306 @@ int listen_port(int p)
 }
 
 
+/* Creates, binds to, and listens on a new Unix domain socket at path,
+ * where a leading '@' names one in the abstract namespace.  A socket file
+ * left behind by an earlier daemon is replaced, but not one that some
+ * process is still accepting on.  Returns the socket, -1 if it could not
+ * be created, -2 if it could not be bound, or -3 if listening failed.
+ */
+int listen_unix(const char *path)
+{
+    int sockfd, probefd, stale;
+    struct sockaddr_un addr;
+    socklen_t len;
+    struct stat st;
+
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    if (!(len = unix_addr(&addr, path))) {
+        close(sockfd);
+        return -2;
+    }
+
+    if (bind(sockfd, (struct sockaddr *) &addr, len) < 0) {
+        if (errno != EADDRINUSE || path[0] == '@' || stat(path, &st) < 0
+                || !S_ISSOCK(st.st_mode)
+                || (probefd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            close(sockfd);
+            return -2;
+        }
+
+        /* nobody answering on an existing socket file means it's stale */
+        stale = connect(probefd, (struct sockaddr *) &addr, len) < 0
+            && errno == ECONNREFUSED;
+        close(probefd);
+
+        if (!stale || unlink(path) < 0
+                || bind(sockfd, (struct sockaddr *) &addr, len) < 0) {
+            close(sockfd);
+            return -2;
+        }
+    }
+
+    if (listen(sockfd, backlog) < 0) {
+        close(sockfd);
+        return -3;
+    }
+
+    return sockfd;
+}
+
+
+/* Body of a listener thread: accepts clients on its own socket and
+ * serves each one to the end itself, either one at a time or, with -u,
+ * from an io_uring loop of its own.  Nothing it accepts is handed to
+ * another thread.
+ */
+void *listener_thread(void *arg)
+{
+    struct listener *l = arg;
+
+    if (use_uring)
+        uring_loop(l->sockfd, l->sig, l->resp_sig, l->respsz);
+    else
+        worker_loop(l->sockfd, l->sig, l->resp_sig, l->respsz);
+
+    return NULL;
+}
+
+
+/* Maps the keygen pad in fname for pad requests, along with the count
+ * of pad (or keys) used so far kept next to it in fname.off.  An indexed
+ * pad's offsets are all checked here, so requests can trust them.
+ * Returns 1, or prints what went wrong and returns 0.
+ */
+int load_pad(const char *fname)
+{
+    struct pad *p = &pads[npads];
+    struct stat st;
+    char offname[4096];
+    void *map;
+    uint64_t k, start, end;
+    size_t linelen;
+    int fd;
+
+    if (npads == MAX_PADS) {
+        fprintf(stderr, "otp_enc_d: at most %d pads\n", MAX_PADS);
+        return 0;
+    }
+
+    if ((fd = open(fname, O_RDONLY)) < 0) {
+        fprintf(stderr, "otp_enc_d: could not read pad %s\n", fname);
+        return 0;
+    }
+
+    map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "otp_enc_d: could not map pad %s\n", fname);
+        return 0;
+    }
+
+    /* the pad is keygen's one line, newline and all, unless it starts
+       with an index; then each key is checked along with its offsets */
+    p->name = fname;
+    p->data = map;
+    p->len = st.st_size;
+    p->index = NULL;
+    p->nkeys = 1;
+    start = 0;
+    end = p->len;
+
+    if (p->len >= PADHDR && memcmp(p->data, PADMAGIC, 8) == 0) {
+        memcpy(&p->nkeys, p->data + 8, 8);
+        p->nkeys = le64toh(p->nkeys);
+        p->index = (const uint64_t *) (p->data + PADHDR);
+
+        if (p->nkeys == 0 || p->nkeys >= (p->len - PADHDR) / 8
+                || le64toh(p->index[0]) < PADHDR + 8 * (p->nkeys + 1)) {
+            fprintf(stderr, "otp_enc_d: pad %s has a bad index\n", fname);
+            return 0;
+        }
+    }
+
+    for (k = 0; k != p->nkeys; ++k) {
+        if (p->index) {
+            start = le64toh(p->index[k]);
+            end = le64toh(p->index[k + 1]);
+            if (end <= start || end > p->len || p->data[end - 1] != '\n') {
+                fprintf(stderr, "otp_enc_d: pad %s has a bad ", fname);
+                fprintf(stderr, "offset for key %llu\n",
+                        (unsigned long long) k);
+                return 0;
+            }
+        }
+
+        if (end > start && p->data[end - 1] == '\n')
+            --end;
+
+        if (!otp_validate(p->data + start, end - start, &linelen)
+                || linelen != end - start) {
+            fprintf(stderr, "otp_enc_d: pad %s ", fname);
+            fprintf(stderr, "contained invalid characters\n");
+            return 0;
+        }
+    }
+
+    if (!p->index)
+        p->len = end;
+
+    /* a daemon that never claims needs no mark, and so can serve a pad
+       it can't write next to */
+    p->next = NULL;
+    if (!PAD_CLAIMS) {
+        ++npads;
+        return 1;
+    }
+
+    /* a fresh pad starts at 0; after that, pick up where we left off */
+    snprintf(offname, sizeof(offname), "%s.off", fname);
+    if ((fd = open(offname, O_RDWR | O_CREAT, 0600)) < 0
+            || (fstat(fd, &st) == 0 && st.st_size < (off_t) sizeof(uint64_t)
+                && ftruncate(fd, sizeof(uint64_t)) < 0)
+            || (map = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "otp_enc_d: could not keep track of pad ");
+        fprintf(stderr, "used in %s\n", offname);
+        return 0;
+    }
+    close(fd);
+
+    p->next = map;
+    ++npads;
+    return 1;
+}
+
+
+/* Takes the memfd a shared memory client passes right after the
+ * handshake and maps it as its ring, storing the size in *size.  It
+ * has to be sealed against shrinking, or the client could pull the
+ * mapping out from under us.  Returns the ring, or NULL.
+ */
+char *map_ring(int sockfd, uint64_t *size)
+{
+    char byte, ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    struct stat st;
+    void *ring = MAP_FAILED;
+    int fd = -1, seals;
+    ssize_t n;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl;
+    mh.msg_controllen = sizeof(ctl);
+
+    while ((n = recvmsg(sockfd, &mh, 0)) < 0 && errno == EINTR)
+        ;
+
+    cm = (n == 1) ? CMSG_FIRSTHDR(&mh) : NULL;
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS
+            && cm->cmsg_len == CMSG_LEN(sizeof(int)))
+        memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+    if (fd < 0)
+        return NULL;
+
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals >= 0 && (seals & F_SEAL_SHRINK) && fstat(fd, &st) == 0
+            && st.st_size > 0)
+        ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+    close(fd);
+
+    if (ring == MAP_FAILED)
+        return NULL;
+
+    *size = st.st_size;
+    return ring;
+}
+
+
+/* Current monotonic time in seconds */
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Adds the time since started to a latency histogram and its sum */
+void observe(unsigned long *hist, unsigned long *sum_ns, double started)
+{
+    double us = (now() - started) * 1e6;
+    int i;
+
+    for (i = 0; i != NUM_BUCKETS && us > bucket_us[i]; ++i)
+        ;
+
+    stat_add(&hist[i], 1);
+    stat_add(sum_ns, (long) (us * 1000));
+}
+
+
+/* SIGCHLD handler: does nothing itself, but interrupts the
+ * parent's accept() so finished children are reaped, and their places
+ * given back, right away
+ */
+void on_child(int sig)
+{
+}
+
+
+/* SIGUSR1 handler: leaves a note for the parent to dump the metrics */
+void on_dump(int sig)
+{
+    dump_requested = 1;
+}
+
+
+/* SIGTERM and SIGINT handler in a pool's parent: leaves a note for it to
+ * stop its workers and exit
+ */
+void on_stop(int sig)
+{
+    stop_requested = 1;
+}
+
+
+/* Fills in a FRAME_HDR-byte frame header */
+void pack_header(unsigned char *hdr, int type, uint64_t len1, uint64_t len2)
+{
+    int i;
+
+    memset(hdr, 0, FRAME_HDR);
+    hdr[0] = type;
+    for (i = 0; i != 8; ++i) {
+        hdr[4 + i] = len1 >> (56 - 8 * i);
+        hdr[12 + i] = len2 >> (56 - 8 * i);
+    }
+}
+
+
+/* Tells whether pad p has len chars of key at offset off, or for an
+ * indexed pad, in key number off
+ */
+int pad_fits(const struct pad *p, uint64_t off, uint64_t len)
+{
+    if (p->index)
+        return off < p->nkeys && len < le64toh(p->index[off + 1])
+            - le64toh(p->index[off]);
+
+    return off <= p->len && len <= p->len - off;
+}
+
+
 /* Reads all the input from the client (expected to be a message followed 
  * by a key, each terminated by a newline character) and then writes back
  * an encrypted message.
@@ -158,6 +1010,7 @@ int process(int sockfd)
 
     /* counters */
     size_t rdb = 0, trdb = 0, left = sizeof(buffer), len = 0;
+    ssize_t nrd;
 
     /* pointer to first char of key */
     char *key = buffer;
@@ -165,19 +1018,27 @@ int process(int sockfd)
     /* flag set to true after first newline char is found */
     int found_key = 0;
 
+    double started = now();
+
     memset(buffer, 0, sizeof(buffer));
+    start_deadline();
     
     /* read from client until key is found, then read that many more chars
        to reconstruct the key */
     for (;;) {
-        rdb = read(sockfd, buffer + rdb, left);
+        nrd = read_some(sockfd, buffer + trdb, left);
+
+        /* client hung up or something broke before everything arrived */
+        if (nrd <= 0)
+            break;
+        rdb = nrd;
 
         if (!found_key) {
-            for (; (*key != '\n') && (key < buffer + rdb); ++key)
+            for (; (key < buffer + trdb + rdb) && (*key != '\n'); ++key)
                 ++len;
 
             /* key begins after the first newline */
-            if (*key == '\n') {
+            if (key < buffer + trdb + rdb) {
                 ++key;
                 found_key = 1;
             }
@@ -201,169 +1062,1952 @@ int process(int sockfd)
     fprintf(stderr, "%s\n", key);
     */
 
+    /* a client that stopped short, or sent more than the buffer holds,
+       gets nothing back rather than a message encoded with key that
+       never arrived */
+    if (trdb <= 2 * len) {
+        record_request(0, trdb, 0, started);
+        return 0;
+    }
+
     /* allocate memory for encoded message and encode */
     encoded = malloc(len * sizeof(char));
     memset(encoded, 0, len);
     encode(encoded, len, buffer, key);
 
     /* fire it back to the patient client */
-    write(sockfd, encoded, len);
+    write_full(sockfd, encoded, len);
     free(encoded);
+
+    record_request(1, trdb, len, started);
+    return 1;
 }
 
 
-/* Determines a port for future comms with the client and starts listening
- * on a unused port
+/* Framed counterpart of process().  Reads one request frame, whose
+ * header says exactly how much message and key follow, and answers with
+ * a result frame, or an error frame if the request can't be served.
+ * If packed, the message, key and result are packed 5 bits a char.
+ * Returns 1 if a result was sent, -1 if the request was refused but the
+ * next one can still be read, or 0 if the connection is done.
  */
-int propose_port(int sockfd, int oldportno)
+int process_framed(int sockfd, int packed)
 {
-    /* new socket for client to use */
-    int newsockfd;
+    unsigned char hdr[FRAME_HDR];
 
-    /* new port for the socket */
-    int newportno = rand() % 10000 + 50000;
+    /* message (encrypted in place) and the part of the key it uses */
+    char *msg, *key;
 
-    /* buffer to hold string representation of port */
-    char portbuf[6];
+    /* sink for any key beyond the message length */
+    char discard[4096];
 
-    socklen_t clilen;
-    struct sockaddr_in cli_addr;
+    /* bytes of message and of key on the wire */
+    uint64_t msgsz, keysz;
 
-    /* try to use the generated port */
-    newsockfd = listen_port(newportno);
+    uint64_t msglen, keylen, left;
+    size_t n;
+    int ok;
+    double started;
 
-    /* if not successful, keep trying new ports till one works */
-    while (newsockfd < 0) {
-        newportno = rand() % 10000 + 50000;
-        newsockfd = listen_port(newportno);
+    /* a client may think as long as it likes between requests, as long
+       as it doesn't go quiet for idle_ms */
+    deadline = 0;
+    if (!read_full(sockfd, (char *) hdr, sizeof(hdr)))
+        return 0;
+    started = now();
+    start_deadline();
+
+    if (hdr[0] == FRAME_PAD_OP)
+        return process_pad(sockfd, hdr, started, packed);
+
+    /* a frame of any other kind can't even be stepped over */
+    if (unpack_header(hdr, &msglen, &keylen) != FRAME_OP) {
+        pack_header(hdr, FRAME_ERROR, 0, 0);
+        write_full(sockfd, (char *) hdr, sizeof(hdr));
+        record_request(0, 0, 0, started);
+        return 0;
     }
 
-    /* convert port number to string */
-    snprintf(portbuf, sizeof(portbuf), "%d", newportno);
+    msgsz = packed ? otp_packed_size(msglen) : msglen;
+    keysz = packed ? otp_packed_size(keylen) : keylen;
 
-    /* send client the port to use from now on */
-    write(sockfd, portbuf, sizeof(portbuf) - 1);
+    /* a short key, or too big to hold */
+    if (keylen < msglen || msglen > FRAME_MAX)
+        return refuse_frame(sockfd, msgsz + keysz, started);
 
-    /* shut down the current socket, over and out */
-    close(sockfd);
-    return newsockfd;
-}
-    
+    /* the header tells us exactly how much room is needed */
+    msg = malloc(msgsz + 1);
+    key = malloc(msgsz + 1);
+    if (!msg || !key) {
+        free(msg);
+        free(key);
+        return refuse_frame(sockfd, msgsz + keysz, started);
+    }
 
-int main(int argc, char *argv[])
-{
-    /* socket file descriptors and ports */
-    int servsockfd, consockfd, clisockfd, portno, newportno;
-    socklen_t clilen;
-    struct sockaddr_in cli_addr;
+    ok = read_full(sockfd, msg, msgsz) && read_full(sockfd, key, msgsz);
 
-    /* handshake signatures */
-    char sig[] = "I am otp_enc";
-    char resp_sig[] = "I am otp_enc_d";
+    /* skip whatever key the message doesn't need */
+    for (left = keysz - msgsz; ok && left > 0; left -= n) {
+        n = (left < sizeof(discard)) ? left : sizeof(discard);
+        ok = read_full(sockfd, discard, n);
+    }
 
-    /* for tracking children */
-    pid_t pid, *bg_pids;
-    int num_bg = 0;
-    int max_bg = 10;
-    
-    bg_pids = malloc(max_bg * sizeof(pid_t));
+    /* a symbol past the end of the alphabet is refused, not wrapped,
+       and so is a char outside it */
+    if (ok && (packed ? !otp_packed_valid((unsigned char *) msg, msglen)
+                || !otp_packed_valid((unsigned char *) key, msglen)
+                : !otp_validate(msg, msglen, &n) || n != msglen
+                || !otp_validate(key, msglen, &n) || n != msglen)) {
+        free(msg);
+        free(key);
+        return refuse_frame(sockfd, 0, started);
+    }
 
-    /* check command line options */
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s port\n", argv[0]);
-        exit(EXIT_FAILURE);
+    if (ok) {
+        if (packed)
+            encode_packed((unsigned char *) msg, msglen,
+                    (unsigned char *) msg, (unsigned char *) key);
+        else
+            encode(msg, msglen, msg, key);
+
+        pack_header(hdr, FRAME_RESULT, msglen, 0);
+        ok = write_full(sockfd, (char *) hdr, sizeof(hdr))
+            && write_full(sockfd, msg, msgsz);
     }
 
-    srand(time(0));
+    free(msg);
+    free(key);
 
-    /* get and use the port passed as argument to listen on new socket */
-    portno = atoi(argv[1]);
-    servsockfd = listen_port(portno);
+    record_request(ok, ok ? msgsz + keysz : 0, ok ? msgsz : 0, started);
+    return ok;
+}
 
-    /* check reason for failure to listen on new socket, if any */
-    switch (servsockfd) {
-        case -3: {
-            fprintf(stderr, "otp_enc_d: unable to listen on port %d\n", portno);
-            close(servsockfd);
-            exit(EXIT_FAILURE);
-        }
-        case -2: {
-            fprintf(stderr, "otp_enc_d: unable to bind socket on port ");
-            fprintf(stderr, "%d\n", portno);
+
+/* Serves a pad request whose header hdr has been read: only the message
+ * follows, and the key comes straight out of the mapped pad.  Answers
+ * like process_framed(), with the pad offset used in the result frame.
+ * A packed message is unpacked against the pad's chars and the result
+ * packed again.  Returns what process_framed() does.
+ */
+int process_pad(int sockfd, const unsigned char *hdr, double started,
+        int packed)
+{
+    unsigned char rhdr[FRAME_HDR];
+    uint64_t msglen, msgsz, off;
+    const char *key = NULL;
+    char *msg = NULL;
+    size_t n;
+    int ok;
+
+    unpack_header(hdr, &msglen, &off);
+    msgsz = packed ? otp_packed_size(msglen) : msglen;
+
+    /* too big, no such pad, or not enough of it left */
+    if (msglen > FRAME_MAX || !(key = claim_pad(hdr[1], &off, msglen))
+            || !(msg = malloc(msglen + 1)))
+        return refuse_frame(sockfd, msgsz, started);
+
+    ok = read_full(sockfd, msg, msgsz);
+
+    if (ok && (packed ? !otp_packed_valid((unsigned char *) msg, msglen)
+                : !otp_validate(msg, msglen, &n) || n != msglen)) {
+        free(msg);
+        return refuse_frame(sockfd, 0, started);
+    }
+
+    if (ok) {
+        if (packed)
+            otp_unpack(msg, (unsigned char *) msg, msglen);
+        encode(msg, msglen, msg, (char *) key);
+        if (packed)
+            otp_pack((unsigned char *) msg, msg, msglen);
+
+        pack_header(rhdr, FRAME_RESULT, msglen, off);
+        ok = write_full(sockfd, (char *) rhdr, sizeof(rhdr))
+            && write_full(sockfd, msg, msgsz);
+    }
+
+    free(msg);
+
+    record_request(ok, ok ? msgsz : 0, ok ? msgsz : 0, started);
+    return ok;
+}
+
+
+/* Shared memory counterpart of process_framed().  Reads one doorbell
+ * and transforms the message it points to in the ringsz-byte ring, in
+ * place, then rings back with the result or an error.  Returns 1 if a
+ * result was sent.
+ */
+int process_shm(int sockfd, char *ring, uint64_t ringsz)
+{
+    unsigned char bell[SHM_DOORBELL];
+    uint64_t msglen, keylen, off, padoff = 0;
+    const char *key = NULL;
+    int type, i, ok;
+    double started, started_encode;
+
+    /* as with frames, the client may take its time between requests */
+    deadline = 0;
+    if (!read_full(sockfd, (char *) bell, sizeof(bell)))
+        return 0;
+    started = now();
+    start_deadline();
+
+    type = unpack_header(bell, &msglen, &keylen);
+    for (off = 0, i = 0; i != 8; ++i)
+        off = (off << 8) | bell[FRAME_HDR + i];
+
+    /* everything the request names has to lie inside the ring, and only
+       then is any pad claimed for it */
+    if (type == FRAME_PAD_OP) {
+        padoff = keylen;
+        keylen = 0;
+        ok = msglen <= ringsz && off <= ringsz - msglen
+            && (key = claim_pad(bell[1], &padoff, msglen));
+    } else {
+        ok = type == FRAME_OP && keylen >= msglen && keylen <= ringsz
+            && msglen <= ringsz - keylen && off <= ringsz - keylen - msglen;
+        key = ring + off + msglen;
+    }
+
+    /* not through encode(): its terminating NUL would land on the key,
+       or past the end of the ring for a message that ends there */
+    if (ok) {
+        started_encode = now();
+        otp_transform(OTP_OP, ring + off, msglen, ring + off, key);
+        observe(stats->encode_hist, &stats->encode_sum_ns, started_encode);
+        pack_header(bell, FRAME_RESULT, msglen, padoff);
+    } else {
+        pack_header(bell, FRAME_ERROR, 0, 0);
+    }
+    ok = write_full(sockfd, (char *) bell, sizeof(bell)) && ok;
+
+    record_request(ok, ok ? msglen + keylen : 0, ok ? msglen : 0, started);
+    return ok;
+}
+
+
+/* Streaming counterpart of process().  The client first sends the
+ * message length in decimal followed by a newline, then alternates
+ * STREAM_CHUNK-sized pieces of message and key (the last pair may be
+ * shorter).  Each pair is encrypted and written back as soon as it
+ * arrives, so memory use does not depend on the message length.
+ * Returns 1 if the whole message was handled.
+ */
+int process_stream(int sockfd)
+{
+    /* one chunk each of message, key, and encrypted output */
+    char msgbuf[STREAM_CHUNK], keybuf[STREAM_CHUNK];
+    char encoded[STREAM_CHUNK + 1];
+
+    /* decimal message length as sent by the client */
+    char lenbuf[24];
+
+    unsigned long long left, done = 0;
+    size_t n, i = 0;
+    double started;
+
+    start_deadline();
+
+    /* read the length one byte at a time so no message data is eaten */
+    for (;;) {
+        if (i == sizeof(lenbuf) - 1 || !read_full(sockfd, lenbuf + i, 1))
+            return 0;
+        if (lenbuf[i] == '\n')
+            break;
+        ++i;
+    }
+    lenbuf[i] = '\0';
+    left = strtoull(lenbuf, NULL, 10);
+    started = now();
+
+    /* encrypt chunk by chunk, sending each one straight back */
+    while (left > 0) {
+        n = (left < STREAM_CHUNK) ? left : STREAM_CHUNK;
+
+        if (!read_full(sockfd, msgbuf, n) || !read_full(sockfd, keybuf, n)
+                || (encode(encoded, n, msgbuf, keybuf),
+                    !write_full(sockfd, encoded, n))) {
+            record_request(0, 2 * done, done, started);
+            return 0;
+        }
+
+        done += n;
+        left -= n;
+    }
+
+    record_request(1, 2 * done, done, started);
+    return 1;
+}
+
+
+/* Tells what kind of address addr is.  Returns the port number if it
+ * is all digits and a valid port, -1 if it is all digits but not a valid
+ * port, or 0 if it is to be taken as a Unix domain socket path.
+ */
+int parse_port(const char *addr)
+{
+    const char *c;
+
+    for (c = addr; *c; ++c) {
+        if (*c < '0' || *c > '9')
+            return 0;
+    }
+
+    if (c == addr || c - addr > 5 || atoi(addr) < 1 || atoi(addr) > 65535)
+        return -1;
+
+    return atoi(addr);
+}
+
+
+/* Checks a client signature held in buffer against the expected sig.
+ * Returns the protocol named by its suffix, or PROTO_NONE if it does not
+ * match.
+ */
+int parse_signature(const char *buffer, const char *sig)
+{
+    size_t siglen = strlen(sig);
+    int proto;
+
+    /* signature must start with what was expected */
+    if (strncmp(sig, buffer, siglen) != 0)
+        return PROTO_NONE;
+
+    /* and the rest must name a known protocol this alphabet can use:
+       raw bytes can hold the newlines the original protocols end things
+       with, and only a small alphabet packs into 5 bits */
+    for (proto = PROTO_NONE + 1; proto != NUM_PROTO; ++proto) {
+        if ((OTP_RAW && (proto == PROTO_PORT || proto == PROTO_SINGLE))
+                || (OTP_SYMS > 32 && proto == PROTO_PACKED))
+            continue;
+        if (strcmp(proto_suffix[proto], buffer + siglen) == 0)
+            return proto;
+    }
+
+    return PROTO_NONE;
+}
+
+
+/* Tells whether the request this thread is serving has run past its
+ * deadline, counting it if so
+ */
+int past_deadline(void)
+{
+    if (!deadline || now() < deadline)
+        return 0;
+
+    stat_add(&stats->timeouts[T_REQUEST], 1);
+    return 1;
+}
+
+
+/* Determines a port for future comms with the client and starts listening
+ * on a unused port.  A client that came in over a Unix domain socket is
+ * given a socket in the abstract namespace instead, which needs no
+ * cleaning up afterwards.
+ */
+int propose_port(int sockfd, int oldportno)
+{
+    /* new socket for client to use */
+    int newsockfd;
+
+    /* new port for the socket */
+    int newportno = rand() % 10000 + 50000;
+
+    /* buffer to hold string representation of port */
+    char portbuf[6];
+
+    /* name of the new socket, for a local client */
+    char name[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+
+    if (getsockname(sockfd, (struct sockaddr *) &local, &len) == 0
+            && local.ss_family == AF_UNIX) {
+        do {
+            snprintf(name, sizeof(name), "@otp_enc_d.%d.%d", (int) getpid(),
+                    rand());
+        } while ((newsockfd = listen_unix(name)) == -2);
+
+        if (newsockfd >= 0)
+            write(sockfd, name, strlen(name));
+
+        close(sockfd);
+        return newsockfd;
+    }
+
+    /* try to use the generated port */
+    newsockfd = listen_port(newportno, 0);
+
+    /* if not successful, keep trying new ports till one works */
+    while (newsockfd < 0) {
+        newportno = rand() % 10000 + 50000;
+        newsockfd = listen_port(newportno, 0);
+    }
+
+    /* convert port number to string */
+    snprintf(portbuf, sizeof(portbuf), "%d", newportno);
+
+    /* send client the port to use from now on */
+    write(sockfd, portbuf, sizeof(portbuf) - 1);
+
+    /* shut down the current socket, over and out */
+    close(sockfd);
+    return newsockfd;
+}
+
+/* Reads exactly len bytes from sockfd into buf.  Returns 1 on success
+ * or 0 if the client hung up or the read failed first.
+ */
+int read_full(int sockfd, char *buf, size_t len)
+{
+    ssize_t rdb;
+
+    while (len > 0) {
+        if ((rdb = read_some(sockfd, buf, len)) <= 0)
+            return 0;
+
+        buf += rdb;
+        len -= rdb;
+    }
+
+    return 1;
+}
+
+
+/* Reads up to len bytes from sockfd into buf, unless the request has run
+ * out of time.  Returns the number read, 0 if the client hung up, or -1
+ * if the read failed, the client went quiet for idle_ms, or the deadline
+ * passed; either of the last two is counted.
+ */
+ssize_t read_some(int sockfd, char *buf, size_t len)
+{
+    ssize_t rdb;
+
+    if (past_deadline())
+        return -1;
+
+    while ((rdb = read(sockfd, buf, len)) < 0 && errno == EINTR)
+        ;
+
+    if (rdb < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        stat_add(&stats->timeouts[T_IDLE], 1);
+
+    return rdb;
+}
+
+
+/* Counts one request, successful or not, with its byte counts and the
+ * time taken since started
+ */
+void record_request(int ok, unsigned long in, unsigned long out,
+        double started)
+{
+    stat_add(ok ? &stats->requests : &stats->request_errors, 1);
+    stat_add(&stats->bytes_in, in);
+    stat_add(&stats->bytes_out, out);
+    observe(stats->request_hist, &stats->request_sum_ns, started);
+}
+
+
+/* Turns away a client the parent has no room to fork a child for.  The
+ * write side is shut first and whatever the client has already sent is
+ * read off, so hanging up doesn't reset the connection under the busy
+ * reply before the client reads it.
+ */
+void refuse(int sockfd)
+{
+    char buf[64];
+
+    stat_add(&stats->connections, 1);
+    send_busy(sockfd);
+    shutdown(sockfd, SHUT_WR);
+    while (recv(sockfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    close(sockfd);
+}
+
+
+/* Answers a framed request that can't be served with an error frame,
+ * once the skip bytes of it still on the way have been read off, so the
+ * next request is read from its start.  Returns -1 if the connection
+ * can go on, or 0 if it broke.
+ */
+int refuse_frame(int sockfd, uint64_t skip, double started)
+{
+    unsigned char hdr[FRAME_HDR];
+    char discard[4096];
+    size_t n;
+
+    record_request(0, 0, 0, started);
+
+    for (; skip > 0; skip -= n) {
+        n = (skip < sizeof(discard)) ? skip : sizeof(discard);
+        if (!read_full(sockfd, discard, n))
+            return 0;
+    }
+
+    pack_header(hdr, FRAME_ERROR, 0, 0);
+    return write_full(sockfd, (char *) hdr, sizeof(hdr)) ? -1 : 0;
+}
+
+
+/* Gives back a place admit() gave this process */
+void release(void)
+{
+    if (held)
+        stat_add((unsigned long *) held, -1);
+    stat_add((unsigned long *) &stats->active, -1);
+}
+
+
+/* Pre-forks nworkers long-lived workers that all accept on servsockfd,
+ * then waits on them, replacing any worker that exits so the pool stays
+ * at full strength, and giving back any places the dead worker held
+ * from admit().  On SIGTERM or SIGINT the workers are stopped and
+ * waited for, so none is left holding the port, and 1 is returned.
+ */
+int run_pool(int servsockfd, int nworkers, const char *sig,
+        const char *resp_sig, size_t respsz)
+{
+    struct sigaction sa;
+    pid_t *workers, pid;
+    long *held_by;
+    int i, status;
+
+    if (!(workers = malloc(nworkers * sizeof(pid_t)))) {
+        perror("could not allocate memory");
+        return 0;
+    }
+
+    /* what each worker holds, where the parent can see it */
+    held_by = mmap(NULL, nworkers * sizeof(long), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (held_by == MAP_FAILED) {
+        perror("could not allocate memory");
+        free(workers);
+        return 0;
+    }
+
+    /* no SA_RESTART, so a stop breaks the parent out of wait() */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    /* fill the pool */
+    for (i = 0; i != nworkers; ++i) {
+        if ((workers[i] = spawn_worker(servsockfd, &held_by[i], sig,
+                        resp_sig, respsz)) < 0) {
+            fprintf(stderr, "otp_enc_d: failed to fork worker\n");
+            free(workers);
+            return 0;
+        }
+    }
+
+    /* reap workers as they die and start replacements in their slots */
+    while (!stop_requested) {
+        pid = wait(&status);
+
+        if (pid < 0) {
+            if (errno == EINTR) {
+                check_dump();
+                continue;
+            }
+            break;
+        }
+
+        for (i = 0; i != nworkers; ++i) {
+            if (workers[i] == pid) {
+                stat_add((unsigned long *) &stats->active, -held_by[i]);
+                held_by[i] = 0;
+                workers[i] = spawn_worker(servsockfd, &held_by[i], sig,
+                        resp_sig, respsz);
+                break;
+            }
+        }
+    }
+
+    /* the pool, and the metrics process, go down with their parent */
+    for (i = 0; i != nworkers; ++i) {
+        if (workers[i] > 0)
+            kill(workers[i], SIGTERM);
+    }
+    if (admin_pid > 0)
+        kill(admin_pid, SIGTERM);
+    while (wait(&status) > 0 || errno == EINTR)
+        ;
+
+    munmap(held_by, nworkers * sizeof(long));
+    free(workers);
+    return 1;
+}
+
+
+/* Starts nthreads listener threads, each accepting and serving clients
+ * on its own SO_REUSEPORT socket on addr, the first taking servsockfd.
+ * A Unix domain socket can't be shared out that way, so there every
+ * thread accepts on servsockfd.  The calling thread is left to dump the
+ * metrics on SIGUSR1 and never returns unless a thread fails to start.
+ */
+int run_threads(const char *addr, int servsockfd, int nthreads,
+        const char *sig, const char *resp_sig, size_t respsz)
+{
+    struct listener *ls;
+    pthread_t tid;
+    sigset_t block, old;
+    int i;
+
+    if (!(ls = calloc(nthreads, sizeof(struct listener)))) {
+        perror("could not allocate memory");
+        return 0;
+    }
+
+    /* the listeners leave every signal to this thread, so the metrics
+       are never dumped from the middle of a request */
+    sigemptyset(&block);
+    sigaddset(&block, SIGUSR1);
+    sigaddset(&block, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    for (i = 0; i != nthreads; ++i) {
+        ls[i].sockfd = servsockfd;
+        if (i > 0 && parse_port(addr) > 0
+                && (ls[i].sockfd = listen_addr(addr, 1)) < 0) {
+            fprintf(stderr, "otp_enc_d: unable to open listener %d ", i);
+            fprintf(stderr, "on port %s\n", addr);
+            return 0;
+        }
+        ls[i].sig = sig;
+        ls[i].resp_sig = resp_sig;
+        ls[i].respsz = respsz;
+
+        if (pthread_create(&tid, NULL, listener_thread, &ls[i]) != 0) {
+            fprintf(stderr, "otp_enc_d: failed to start listener ");
+            fprintf(stderr, "thread %d\n", i);
+            return 0;
+        }
+        pthread_detach(tid);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    for (;;) {
+        pause();
+        check_dump();
+    }
+}
+
+
+/* Tells a client there is no room for it right now, and how long to
+ * wait before trying again
+ */
+void send_busy(int sockfd)
+{
+    char msg[32];
+
+    snprintf(msg, sizeof(msg), "%s %d", BUSY_SIG, BUSY_RETRY_MS);
+    write_full(sockfd, msg, strlen(msg));
+}
+
+
+/* Handles one client connected on consockfd from handshake through to
+ * sending back the encrypted message.  Returns 1 if the client was served.
+ */
+int serve_client(int consockfd, const char *sig,
+        const char *resp_sig, size_t respsz)
+{
+    int proto, ok;
+
+    stat_add(&stats->connections, 1);
+
+    /* make sure the client is who it claims to be, and that there is
+       room for it */
+    proto = handshake(consockfd, sig, resp_sig, respsz);
+    if (proto <= PROTO_NONE) {
+        if (proto == PROTO_NONE)
+            stat_add(&stats->handshake_failures, 1);
+        close(consockfd);
+        return 0;
+    }
+
+    ok = serve_proto(consockfd, proto);
+    if (!preadmitted)
+        release();
+    return ok;
+}
+
+
+/* Runs the data exchange for a client that asked for protocol proto
+ * and is connected on sockfd
+ */
+int serve_data(int sockfd, int proto)
+{
+    int one = 1, ok = 1;
+    char *ring;
+    uint64_t ringsz;
+
+    if (proto == PROTO_STREAM) {
+        ok = process_stream(sockfd);
+    } else if (proto == PROTO_FRAMED || proto == PROTO_PACKED) {
+        /* a reply is a header write then a payload write; don't let the
+           payload sit waiting on the client's delayed ACK */
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        /* framed connections stay open for as many requests as the
+           client cares to send, answered in order */
+        while (process_framed(sockfd, proto == PROTO_PACKED))
+            ;
+    } else if (proto == PROTO_SHM) {
+        /* a shared memory client answers the handshake with its ring,
+           then rings for as many requests as it cares to send */
+        if ((ring = map_ring(sockfd, &ringsz))) {
+            while (process_shm(sockfd, ring, ringsz))
+                ;
+            munmap(ring, ringsz);
+        } else {
+            ok = 0;
+        }
+    } else {
+        ok = process(sockfd);
+    }
+
+    /* the next client on this thread starts with a clean slate */
+    deadline = 0;
+    return ok;
+}
+
+
+/* Takes a client that passed the handshake for protocol proto on
+ * consockfd through its data exchange, closing the connection after.
+ * Returns 1 if the client was served.
+ */
+int serve_proto(int consockfd, int proto)
+{
+    int accsockfd;
+
+    /* only the original protocol moves the client over to a fresh port;
+       everyone else sends their data right behind the handshake */
+    if (proto == PROTO_PORT) {
+        /* closes consockfd */
+        if ((accsockfd = accept_data(propose_port(consockfd, 0))) < 0)
+            return 0;
+    } else {
+        accsockfd = consockfd;
+    }
+
+    /* get the data, encrypt, and send it back */
+    serve_data(accsockfd, proto);
+    close(accsockfd);
+    return 1;
+}
+
+
+/* Makes reads from and writes to sockfd give up with EAGAIN once they
+ * have waited ms milliseconds, or never if ms is 0
+ */
+void set_timeouts(int sockfd, long ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+
+/* Forks a process that answers every connection to adminport on the
+ * loopback interface with the current metrics.  A client that opens with
+ * an HTTP GET gets an HTTP response, so a scraper can point straight at
+ * it; anything else gets the bare text.  The child dies with the daemon.
+ * Returns the child's pid, or -1 if the admin socket or the fork failed.
+ */
+pid_t spawn_admin(int adminport)
+{
+    int sockfd, consockfd, one = 1;
+    struct sockaddr_in addr;
+    struct pollfd pfd;
+    char req[1024];
+    const char *http = "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+    pid_t parent = getpid(), pid;
+
+    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(adminport);
+    if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(sockfd, MAX_CON) < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    if ((pid = fork()) != 0) {
+        close(sockfd);
+        return pid;
+    }
+
+    signal(SIGUSR1, SIG_IGN);
+
+    /* the daemon may never get to stop this process itself, so go with
+       it rather than hold the admin port for the next one */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+        exit(EXIT_SUCCESS);
+
+    for (;;) {
+        if ((consockfd = accept(sockfd, NULL, NULL)) < 0)
+            continue;
+
+        /* give a scraper a moment to say what it wants; the request
+           has to be read whole, or closing on it resets the connection */
+        pfd.fd = consockfd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 100) > 0 && read(consockfd, req, sizeof(req)) >= 4
+                && memcmp(req, "GET ", 4) == 0)
+            write_full(consockfd, http, strlen(http));
+
+        write_metrics(consockfd);
+        close(consockfd);
+    }
+}
+
+
+/* Forks a single pool worker, which counts the places it holds in
+ * *slot.  The child never returns; the parent gets the child's pid, or
+ * -1 if the fork failed.
+ */
+pid_t spawn_worker(int servsockfd, long *slot, const char *sig,
+        const char *resp_sig, size_t respsz)
+{
+    pid_t parent = getpid(), pid = fork();
+
+    if (pid == 0) {
+        /* only the parent dumps metrics, or stops the pool */
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+
+        /* however the parent goes, even killed outright, don't outlive
+           it holding the port; it may already be gone */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent)
+            exit(EXIT_SUCCESS);
+
+        *slot = 0;
+        held = slot;
+
+        /* give each worker its own sequence of proposed ports */
+        srand(time(0) ^ getpid());
+
+        if (use_uring)
+            uring_loop(servsockfd, sig, resp_sig, respsz);
+        else
+            worker_loop(servsockfd, sig, resp_sig, respsz);
+        exit(EXIT_SUCCESS);
+    }
+
+    return pid;
+}
+
+
+/* Starts the clock on a request served by this thread: it has
+ * request_ms from now to finish
+ */
+void start_deadline(void)
+{
+    deadline = request_ms ? now() + request_ms / 1e3 : 0;
+}
+
+
+/* Atomically adds n to one of the shared counters */
+void stat_add(unsigned long *counter, long n)
+{
+    __atomic_fetch_add(counter, (unsigned long) n, __ATOMIC_RELAXED);
+}
+
+
+/* Fills in addr for the Unix domain socket at path, where a leading '@'
+ * names a socket in the abstract namespace.  Returns the length to pass
+ * along with addr, or 0 if the path is empty or too long.
+ */
+socklen_t unix_addr(struct sockaddr_un *addr, const char *path)
+{
+    size_t len = strlen(path);
+
+    if (len == 0 || len >= sizeof(addr->sun_path))
+        return 0;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len);
+
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + len;
+    }
+
+    return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+
+/* Parses a FRAME_HDR-byte frame header, storing its two lengths, and
+ * returns its type
+ */
+int unpack_header(const unsigned char *hdr, uint64_t *len1, uint64_t *len2)
+{
+    int i;
+
+    *len1 = *len2 = 0;
+    for (i = 0; i != 8; ++i) {
+        *len1 = (*len1 << 8) | hdr[4 + i];
+        *len2 = (*len2 << 8) | hdr[12 + i];
+    }
+
+    return hdr[0];
+}
+
+
+#ifdef HAVE_IO_URING
+/* Moves a connection on after its current transfer has completed */
+void uring_advance(struct uring *r, struct uconn *c, const char *sig,
+        const char *resp_sig, size_t respsz)
+{
+    int proto, type, ok, one = 1;
+
+    switch (c->state) {
+        case U_HANDSHAKE: {
+            c->hs[c->done] = '\0';
+
+            /* make sure the client is who it claims to be */
+            if ((proto = parse_signature(c->hs, sig)) == PROTO_NONE) {
+                stat_add(&stats->handshake_failures, 1);
+                uring_close(r, c);
+                break;
+            }
+
+            /* no room: say so and hang up */
+            if (!admit()) {
+                snprintf(c->hs, sizeof(c->hs), "%s %d", BUSY_SIG,
+                        BUSY_RETRY_MS);
+                uring_transfer(r, c, U_REFUSE, c->hs, strlen(c->hs));
+                break;
+            }
+            c->admitted = 1;
+
+            /* only framed clients are served by the loop itself */
+            if (proto != PROTO_FRAMED && proto != PROTO_PACKED) {
+                uring_handoff(r, c, proto, resp_sig, respsz);
+                break;
+            }
+            c->packed = proto == PROTO_PACKED;
+
+            setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            uring_transfer(r, c, U_GREET, (char *) resp_sig, respsz - 1);
+            break;
+        }
+        case U_REPLY: {
+            record_request(1, c->wire, c->len - FRAME_HDR, c->started);
+            uring_release(r, c);
+        }
+        /* fall through */
+        case U_ERROR: {
+            c->deadline = 0;
+        }
+        /* fall through - wait for the next request */
+        case U_GREET: {
+            uring_transfer(r, c, U_HEADER, (char *) c->hdr, FRAME_HDR);
+            break;
+        }
+        case U_HEADER: {
+            c->started = now();
+            c->deadline = request_ms ? c->started + request_ms / 1e3 : 0;
+            type = unpack_header(c->hdr, &c->msglen, &c->keylen);
+
+            /* a pad request's key is already here, in the pad */
+            c->padkey = NULL;
+            if (type == FRAME_PAD_OP) {
+                c->padoff = c->keylen;
+                c->keylen = 0;
+                if (c->msglen <= FRAME_MAX)
+                    c->padkey = claim_pad(c->hdr[1], &c->padoff, c->msglen);
+            }
+
+            /* wrong kind of request, a short key, too big to hold, or a
+               pad that can't cover it */
+            if (type == FRAME_PAD_OP)
+                ok = c->padkey != NULL;
+            else
+                ok = type == FRAME_OP && c->keylen >= c->msglen
+                    && c->keylen <= FRAME_MAX;
+
+            c->wire = c->packed
+                ? otp_packed_size(c->msglen) + otp_packed_size(c->keylen)
+                : c->msglen + c->keylen;
+
+            /* a frame of any other kind can't even be stepped over */
+            if (type != FRAME_OP && type != FRAME_PAD_OP) {
+                record_request(0, 0, 0, c->started);
+                pack_header(c->hdr, FRAME_ERROR, 0, 0);
+                uring_transfer(r, c, U_REFUSE, (char *) c->hdr, FRAME_HDR);
+                break;
+            }
+
+            if (!ok || !uring_buffer(r, c)) {
+                record_request(0, 0, 0, c->started);
+                c->skip = c->wire;
+                uring_refuse(r, c);
+                break;
+            }
+
+            if (c->wire == 0)
+                uring_reply(r, c);
+            else
+                uring_transfer(r, c, U_BODY, c->buf + FRAME_HDR, c->wire);
+            break;
+        }
+        case U_BODY: {
+            uring_reply(r, c);
+            break;
+        }
+        case U_SKIP: {
+            c->skip -= c->len;
+            uring_refuse(r, c);
+            break;
+        }
+        default: {
+            uring_close(r, c);
+            break;
+        }
+    }
+}
+
+
+/* Finds a buffer for the request whose header is in c, big enough for
+ * the reply header ahead of the message and key, preferring a registered
+ * one.  A packed pad request needs room to unpack its message.  Returns
+ * 1, or 0 if there is no memory to be had.
+ */
+int uring_buffer(struct uring *r, struct uconn *c)
+{
+    size_t need = FRAME_HDR + ((c->padkey && c->msglen > c->wire)
+            ? c->msglen : c->wire) + 1;
+
+    if (need <= URING_SLOT && r->nfree > 0) {
+        c->slot = r->free_slots[--r->nfree];
+        c->buf = r->slots + (size_t) c->slot * URING_SLOT;
+        return 1;
+    }
+
+    c->slot = -1;
+    return (c->buf = malloc(need)) != NULL;
+}
+
+
+/* Hangs up on a connection and forgets it */
+void uring_close(struct uring *r, struct uconn *c)
+{
+    if (c->admitted)
+        release();
+
+    uring_release(r, c);
+    close(c->fd);
+    free(c);
+    --r->nconns;
+}
+
+
+/* Passes a client that wants anything but the framed protocol to a
+ * forked child, which finishes the handshake and serves it the usual
+ * blocking way.  The client keeps its place from admit() until the
+ * child is reaped.
+ * If there is no child to be had, the client is turned away as busy.
+ */
+void uring_handoff(struct uring *r, struct uconn *c, int proto,
+        const char *resp_sig, size_t respsz)
+{
+    pid_t pid = fork();
+
+    /* the client keeps its place, so hanging up on it gives that back */
+    if (pid < 0) {
+        snprintf(c->hs, sizeof(c->hs), "%s %d", BUSY_SIG, BUSY_RETRY_MS);
+        uring_transfer(r, c, U_REFUSE, c->hs, strlen(c->hs));
+        return;
+    }
+
+    if (pid == 0) {
+        signal(SIGUSR1, SIG_IGN);
+
+        /* let go of the ring, the listener and every other client, or
+           they would not see the loop hang up on them while this child
+           lives; everything else the child needs is mapped */
+        close_range(3, c->fd - 1, 0);
+        close_range(c->fd + 1, ~0U, 0);
+        set_timeouts(c->fd, idle_ms);
+
+        if (write_full(c->fd, resp_sig, respsz - 1))
+            serve_proto(c->fd, proto);
+        exit(EXIT_SUCCESS);
+    }
+
+    /* the child has its own copy of the connection; its place is given
+       back when the loop reaps it, so a child killed outright can't keep
+       it */
+    c->admitted = 0;
+    uring_close(r, c);
+}
+
+
+/* Starts serving a newly accepted connection on fd */
+void uring_open(struct uring *r, int fd)
+{
+    struct uconn *c;
+
+    stat_add(&stats->connections, 1);
+
+    if (!(c = calloc(1, sizeof(struct uconn)))) {
+        close(fd);
+        return;
+    }
+
+    c->fd = fd;
+    c->slot = -1;
+    ++r->nconns;
+
+    /* the signature comes in one piece, as handshake() expects too */
+    uring_transfer(r, c, U_HANDSHAKE, c->hs, sizeof(c->hs) - 1);
+}
+
+
+/* Refuses the request whose header is in c: reads off the c->skip
+ * bytes of its body still to come, then sends an error frame, after
+ * which the next request is read as usual
+ */
+void uring_refuse(struct uring *r, struct uconn *c)
+{
+    /* never read back, so every connection can share it */
+    static char discard[URING_SLOT];
+
+    if (c->skip > 0) {
+        uring_transfer(r, c, U_SKIP, discard, (c->skip < sizeof(discard))
+                ? c->skip : sizeof(discard));
+        return;
+    }
+
+    pack_header(c->hdr, FRAME_ERROR, 0, 0);
+    uring_transfer(r, c, U_ERROR, (char *) c->hdr, FRAME_HDR);
+}
+
+
+/* Gives back the request buffer held by a connection, if any */
+void uring_release(struct uring *r, struct uconn *c)
+{
+    if (c->slot >= 0)
+        r->free_slots[r->nfree++] = c->slot;
+    else
+        free(c->buf);
+
+    c->buf = NULL;
+    c->slot = -1;
+}
+
+
+/* Encrypts the request in c's buffer in place and sends it back, the
+ * reply header going where the request header was read, or refuses it
+ * if it holds a char outside the alphabet
+ */
+void uring_reply(struct uring *r, struct uconn *c)
+{
+    char *msg = c->buf + FRAME_HDR;
+    uint64_t msgsz = c->packed ? otp_packed_size(c->msglen) : c->msglen;
+    size_t n;
+    int ok;
+
+    /* a symbol past the end of the alphabet is refused, not wrapped,
+       and so is a char outside it */
+    if (c->packed)
+        ok = otp_packed_valid((unsigned char *) msg, c->msglen)
+            && (c->padkey || otp_packed_valid((unsigned char *) msg
+                        + msgsz, c->msglen));
+    else
+        ok = otp_validate(msg, c->msglen, &n) && n == c->msglen
+            && (c->padkey || (otp_validate(msg + c->msglen, c->msglen, &n)
+                        && n == c->msglen));
+
+    if (!ok) {
+        record_request(0, 0, 0, c->started);
+        uring_release(r, c);
+        c->skip = 0;
+        uring_refuse(r, c);
+        return;
+    }
+
+    if (c->padkey) {
+        if (c->packed)
+            otp_unpack(msg, (unsigned char *) msg, c->msglen);
+        encode(msg, c->msglen, msg, (char *) c->padkey);
+        if (c->packed)
+            otp_pack((unsigned char *) msg, msg, c->msglen);
+        pack_header((unsigned char *) c->buf, FRAME_RESULT, c->msglen,
+                c->padoff);
+    } else {
+        if (c->packed)
+            encode_packed((unsigned char *) msg, c->msglen,
+                    (unsigned char *) msg, (unsigned char *) msg + msgsz);
+        else
+            encode(msg, c->msglen, msg, msg + c->msglen);
+        pack_header((unsigned char *) c->buf, FRAME_RESULT, c->msglen, 0);
+    }
+    uring_transfer(r, c, U_REPLY, c->buf, FRAME_HDR + msgsz);
+}
+
+
+/* Creates a ring with room for entries submissions, maps its queues,
+ * and registers the request buffers with it if the kernel will take
+ * them (the loop carries on with ordinary buffers if not).  Returns 1 on
+ * success.
+ */
+int uring_setup(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    struct iovec iov[URING_SLOTS];
+    size_t sqsz, cqsz;
+    char *sq, *cq;
+    int i;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return 0;
+
+    /* both rings usually share one mapping */
+    sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqsz > sqsz)
+        sqsz = cqsz;
+
+    sq = mmap(NULL, sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(r->fd);
+        return 0;
+    }
+
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqsz, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            close(r->fd);
+            return 0;
+        }
+    }
+
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+            IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        close(r->fd);
+        return 0;
+    }
+
+    r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    r->tail = *r->sq_tail;
+
+    /* a child handed a client must not keep the ring alive, and with it
+       the accept queued on the listener, after this process is gone */
+    madvise(sq, sqsz, MADV_DONTFORK);
+    if (cq != sq)
+        madvise(cq, cqsz, MADV_DONTFORK);
+    madvise(r->sqes, p.sq_entries * sizeof(struct io_uring_sqe),
+            MADV_DONTFORK);
+
+    /* pin the request buffers once so reads and writes into them skip
+       mapping user pages on every call */
+    r->slots = mmap(NULL, (size_t) URING_SLOTS * URING_SLOT,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->slots == MAP_FAILED) {
+        r->slots = NULL;
+        return 1;
+    }
+
+    for (i = 0; i != URING_SLOTS; ++i) {
+        iov[i].iov_base = r->slots + (size_t) i * URING_SLOT;
+        iov[i].iov_len = URING_SLOT;
+        r->free_slots[i] = URING_SLOTS - 1 - i;
+    }
+
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                iov, URING_SLOTS) < 0) {
+        munmap(r->slots, (size_t) URING_SLOTS * URING_SLOT);
+        r->slots = NULL;
+        return 1;
+    }
+
+    r->nfree = URING_SLOTS;
+    return 1;
+}
+
+
+/* Claims the next submission queue entry, cleared.  The ring is sized
+ * so it never fills: every connection has at most one transfer queued,
+ * and its timeout, plus the one accept.
+ */
+struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+    unsigned idx = r->tail++ & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    ++r->pending;
+    return sqe;
+}
+
+
+/* Puts c in state and queues a transfer of len bytes at io: a read,
+ * unless the state is one that sends.  Transfers within c's registered
+ * buffer use the fixed-buffer operations.  The transfer is cancelled if
+ * it is still waiting when the nearest of c's deadlines comes due.
+ */
+void uring_transfer(struct uring *r, struct uconn *c, int state, char *io,
+        size_t len)
+{
+    struct io_uring_sqe *sqe;
+    int sending = state == U_GREET || state == U_REPLY || state == U_REFUSE
+        || state == U_ERROR;
+    size_t left;
+    long ms, due;
+
+    if (io) {
+        c->state = state;
+        c->io = io;
+        c->len = len;
+        c->done = 0;
+    }
+
+    left = c->len - c->done;
+    if (left > (1U << 30))
+        left = 1U << 30;
+
+    sqe = uring_sqe(r);
+    sqe->fd = c->fd;
+    sqe->addr = (unsigned long) (c->io + c->done);
+    sqe->len = left;
+    sqe->user_data = (unsigned long) c;
+
+    if (c->slot >= 0 && c->io >= c->buf && c->io < c->buf + URING_SLOT) {
+        sqe->opcode = sending ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = c->slot;
+    } else {
+        sqe->opcode = sending ? IORING_OP_SEND : IORING_OP_RECV;
+        sqe->msg_flags = sending ? MSG_NOSIGNAL : 0;
+    }
+
+    /* the handshake has its own deadline; after it, every transfer gets
+       idle_ms, or what is left of the request's time if that is less */
+    c->limit = (c->state == U_HANDSHAKE || c->state == U_GREET)
+        ? T_HANDSHAKE : T_IDLE;
+    ms = (c->limit == T_HANDSHAKE) ? handshake_ms : idle_ms;
+    if (c->deadline) {
+        due = (long) ((c->deadline - now()) * 1e3);
+        if (due < 1)
+            due = 1;
+        if (!ms || due < ms) {
+            ms = due;
+            c->limit = T_REQUEST;
+        }
+    }
+
+    c->expires = ms ? now() + ms / 1e3 : 0;
+    if (!ms)
+        return;
+
+    c->ts.tv_sec = ms / 1000;
+    c->ts.tv_nsec = (ms % 1000) * 1000000;
+    sqe->flags |= IOSQE_IO_LINK;
+
+    sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (unsigned long) &c->ts;
+    sqe->len = 1;
+    sqe->user_data = U_TIMER;
+}
+#endif
+
+
+/* Tells whether this kernel lets us set up an io_uring */
+int uring_available(void)
+{
+#ifdef HAVE_IO_URING
+    struct io_uring_params p;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = syscall(__NR_io_uring_setup, 1, &p)) < 0)
+        return 0;
+
+    close(fd);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+/* Body of an io_uring worker: accepts clients on the shared listening
+ * socket and serves every framed client it has from one event loop, for
+ * the life of the process.  Clients wanting the other protocols are
+ * handed to forked children.
+ */
+void uring_loop(int servsockfd, const char *sig,
+        const char *resp_sig, size_t respsz)
+{
+#ifdef HAVE_IO_URING
+    struct uring r;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct uconn *c;
+    struct sigaction sa;
+    unsigned head, tail;
+    pid_t pid;
+    int res, status;
+
+    if (!uring_setup(&r, URING_ENTRIES)) {
+        perror("otp_enc_d: io_uring setup");
+        exit(EXIT_FAILURE);
+    }
+
+    /* a child handed a client interrupts the wait below when it is done,
+       so its place is given back before the next client is admitted */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_child;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    for (;;) {
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            if (pid != admin_pid)
+                release();
+        }
+
+        /* keep an accept queued until the connection table is full */
+        if (!r.accepting && r.nconns < URING_CONNS) {
+            sqe = uring_sqe(&r);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = servsockfd;
+            r.accepting = 1;
+        }
+
+        /* hand the kernel everything queued, now that it is filled in,
+           and wait for at least one result */
+        __atomic_store_n(r.sq_tail, r.tail, __ATOMIC_RELEASE);
+        if (syscall(__NR_io_uring_enter, r.fd, r.pending, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if (errno == EINTR) {
+                check_dump();
+                continue;
+            }
+            perror("otp_enc_d: io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        r.pending = 0;
+
+        head = *r.cq_head;
+        tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; ++head) {
+            cqe = &r.cqes[head & *r.cq_mask];
+            if (cqe->user_data == U_TIMER)
+                continue;
+
+            c = (struct uconn *) (unsigned long) cqe->user_data;
+            res = cqe->res;
+
+            if (!c) {
+                r.accepting = 0;
+                if (res >= 0)
+                    uring_open(&r, res);
+            } else if (res == -ECANCELED || ((res == -EINTR || res == -EAGAIN)
+                        && c->expires && now() >= c->expires)) {
+                /* its timeout went off first */
+                stat_add(&stats->timeouts[c->limit], 1);
+                uring_close(&r, c);
+            } else if (res == -EINTR || res == -EAGAIN) {
+                uring_transfer(&r, c, c->state, NULL, 0);
+            } else if (res <= 0) {
+                /* hung up or broken */
+                uring_close(&r, c);
+            } else {
+                c->done += res;
+                if (c->state != U_HANDSHAKE && c->done < c->len)
+                    uring_transfer(&r, c, c->state, NULL, 0);
+                else
+                    uring_advance(&r, c, sig, resp_sig, respsz);
+            }
+        }
+
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+#else
+    exit(EXIT_FAILURE);
+#endif
+}
+
+
+/* Body of a pre-forked worker: accepts clients on the shared listening
+ * socket and serves them one after another for the life of the process.
+ */
+void worker_loop(int servsockfd, const char *sig,
+        const char *resp_sig, size_t respsz)
+{
+    int consockfd;
+    socklen_t clilen;
+    struct sockaddr_in cli_addr;
+
+    for (;;) {
+        clilen = sizeof(cli_addr);
+        consockfd = accept(servsockfd, (struct sockaddr *) &cli_addr, &clilen);
+
+        if (consockfd < 0) {
+            /* interrupted or the client gave up early; keep going */
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("otp_enc_d: accept");
+            exit(EXIT_FAILURE);
+        }
+
+        serve_client(consockfd, sig, resp_sig, respsz);
+    }
+}
+
+
+/* Writes all len bytes of buf to sockfd.  Returns 1 on success or 0 if
+ * the client went away first.
+ */
+int write_full(int sockfd, const char *buf, size_t len)
+{
+    ssize_t wrb;
+
+    while (len > 0) {
+        if (past_deadline())
+            return 0;
+
+        wrb = write(sockfd, buf, len);
+
+        if (wrb < 0 && errno == EINTR)
+            continue;
+        if (wrb < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            stat_add(&stats->timeouts[T_IDLE], 1);
+        if (wrb <= 0)
+            return 0;
+
+        buf += wrb;
+        len -= wrb;
+    }
+
+    return 1;
+}
+
+
+/* Writes the shared metrics to fd in the Prometheus text exposition
+ * format.  Returns 1 if they were written.
+ */
+int write_metrics(int fd)
+{
+    /* the histograms, and the label and sum each is reported with */
+    unsigned long *hists[2] = { stats->request_hist, stats->encode_hist };
+    unsigned long *sums[2] = { &stats->request_sum_ns, &stats->encode_sum_ns };
+    const char *names[2] = { "request_duration_seconds",
+        "encode_duration_seconds" };
+    const char *helps[2] = { "Time to read, transform and answer a request.",
+        "Time spent in the OTP kernel per call." };
+
+    unsigned long cumulative;
+    FILE *f;
+    int h, i;
+
+    if ((fd = dup(fd)) < 0 || !(f = fdopen(fd, "w")))
+        return 0;
+
+#define COUNTER(name, help, value) \
+    fprintf(f, "# HELP %s_%s %s\n# TYPE %s_%s counter\n%s_%s %lu\n", \
+            METRIC_PREFIX, name, help, METRIC_PREFIX, name, \
+            METRIC_PREFIX, name, (unsigned long) (value))
+#define GAUGE(name, help, value) \
+    fprintf(f, "# HELP %s_%s %s\n# TYPE %s_%s gauge\n%s_%s %ld\n", \
+            METRIC_PREFIX, name, help, METRIC_PREFIX, name, \
+            METRIC_PREFIX, name, (long) (value))
+
+    COUNTER("connections_total", "Client connections accepted.",
+            stats->connections);
+    COUNTER("handshake_failures_total", "Clients rejected at handshake.",
+            stats->handshake_failures);
+    COUNTER("busy_total", "Clients turned away for want of room.",
+            stats->busy);
+    COUNTER("handshake_timeouts_total",
+            "Clients hung up on for a handshake not done in time.",
+            stats->timeouts[T_HANDSHAKE]);
+    COUNTER("idle_timeouts_total",
+            "Clients hung up on for going quiet mid-conversation.",
+            stats->timeouts[T_IDLE]);
+    COUNTER("request_timeouts_total",
+            "Clients hung up on for a request that ran too long.",
+            stats->timeouts[T_REQUEST]);
+    COUNTER("requests_total", "Requests answered.", stats->requests);
+    COUNTER("request_errors_total", "Requests refused or cut short.",
+            stats->request_errors);
+    COUNTER("bytes_in_total", "Message and key bytes received.",
+            stats->bytes_in);
+    COUNTER("bytes_out_total", "Result bytes sent.", stats->bytes_out);
+    GAUGE("active_workers", "Clients being served right now.",
+            stats->active);
+    GAUGE("pool_workers", "Pre-forked workers, 0 when forking per client.",
+            stats->pool_size);
+    GAUGE("listener_threads", "Listener threads, 0 unless -t was given.",
+            stats->threads);
+    GAUGE("max_inflight", "Most clients served at once.", max_inflight);
+
+#undef COUNTER
+#undef GAUGE
+
+    for (h = 0; h != 2; ++h) {
+        fprintf(f, "# HELP %s_%s %s\n", METRIC_PREFIX, names[h], helps[h]);
+        fprintf(f, "# TYPE %s_%s histogram\n", METRIC_PREFIX, names[h]);
+
+        cumulative = 0;
+        for (i = 0; i <= NUM_BUCKETS; ++i) {
+            cumulative += hists[h][i];
+            if (i < NUM_BUCKETS)
+                fprintf(f, "%s_%s_bucket{le=\"%g\"} %lu\n", METRIC_PREFIX,
+                        names[h], bucket_us[i] / 1e6, cumulative);
+            else
+                fprintf(f, "%s_%s_bucket{le=\"+Inf\"} %lu\n", METRIC_PREFIX,
+                        names[h], cumulative);
+        }
+
+        fprintf(f, "%s_%s_sum %.9f\n", METRIC_PREFIX, names[h],
+                *sums[h] / 1e9);
+        fprintf(f, "%s_%s_count %lu\n", METRIC_PREFIX, names[h], cumulative);
+    }
+
+    return fclose(f) == 0;
+}
+    
+
+int main(int argc, char *argv[])
+{
+    /* socket file descriptors and ports */
+    int servsockfd, consockfd, clisockfd, portno, newportno;
+    socklen_t clilen;
+    struct sockaddr_in cli_addr;
+
+    /* handshake signatures */
+    char sig[] = "I am otp_enc" OTP_TAG;
+    char resp_sig[] = "I am otp_enc_d";
+
+    /* for tracking children */
+    pid_t pid, *bg_pids, *grown;
+    int num_bg = 0;
+    int max_bg = 10;
+
+    /* size of the pre-forked worker pool, 0 means fork per client */
+    int nworkers = 0;
+
+    /* listener threads started with -t, 0 means none */
+    long nthreads = 0;
+    int opt;
+
+    /* OTP kernel requested with -k, NULL picks the best available */
+    const char *kernel = NULL;
+
+    /* loopback port given with -a for reading the metrics, 0 for none */
+    int adminport = 0;
+
+    /* anything trailing the deadlines given with -d */
+    char extra;
+
+    struct sigaction sa;
+    
+    bg_pids = malloc(max_bg * sizeof(pid_t));
+
+    /* check command line options */
+    while ((opt = getopt(argc, argv, "a:d:k:m:p:q:t:uw:")) != -1) {
+        switch (opt) {
+            case 'a': {
+                adminport = atoi(optarg);
+                if (adminport < 1 || adminport > 65535) {
+                    fprintf(stderr, "otp_enc_d: invalid admin port\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'd': {
+                if (sscanf(optarg, "%ld,%ld,%ld%c", &handshake_ms, &idle_ms,
+                            &request_ms, &extra) != 3 || handshake_ms < 0
+                        || idle_ms < 0 || request_ms < 0) {
+                    fprintf(stderr, "otp_enc_d: deadlines must be given ");
+                    fprintf(stderr, "as handshake,idle,request in ms\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'k': {
+                kernel = optarg;
+                break;
+            }
+            case 'm': {
+                if ((max_inflight = atol(optarg)) < 1) {
+                    fprintf(stderr, "otp_enc_d: need room for at least ");
+                    fprintf(stderr, "1 client\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'p': {
+                if (!load_pad(optarg))
+                    exit(EXIT_FAILURE);
+                break;
+            }
+            case 'q': {
+                if ((backlog = atoi(optarg)) < 1) {
+                    fprintf(stderr, "otp_enc_d: accept queue must hold ");
+                    fprintf(stderr, "at least 1 connection\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 't': {
+                /* -t 0 is one per core */
+                if ((nthreads = atol(optarg)) == 0)
+                    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+                if (nthreads < 1 || nthreads > MAX_THREADS) {
+                    fprintf(stderr, "otp_enc_d: thread count must be ");
+                    fprintf(stderr, "between 1 and %d\n", MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'u': {
+                use_uring = 1;
+                break;
+            }
+            case 'w': {
+                nworkers = atoi(optarg);
+                if (nworkers < 1 || nworkers > MAX_WORKERS) {
+                    fprintf(stderr, "otp_enc_d: worker count must be ");
+                    fprintf(stderr, "between 1 and %d\n", MAX_WORKERS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            default: {
+                fprintf(stderr, "Usage: %s [-a adminport] ", argv[0]);
+                fprintf(stderr, "[-d handshake,idle,request] ");
+                fprintf(stderr, "[-k kernel] [-m max-inflight] ");
+                fprintf(stderr, "[-p pad ...] [-q queue] [-t threads] ");
+                fprintf(stderr, "[-u] [-w workers] port|socket\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-a adminport] ", argv[0]);
+        fprintf(stderr, "[-d handshake,idle,request] [-k kernel] ");
+        fprintf(stderr, "[-m max-inflight] [-p pad ...] [-q queue] ");
+        fprintf(stderr, "[-t threads] [-u] [-w workers] port|socket\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (nthreads && nworkers) {
+        fprintf(stderr, "otp_enc_d: -t and -w can't be used together\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* pick the OTP kernel before any worker is forked */
+    if (!otp_select(kernel)) {
+        fprintf(stderr, "otp_enc_d: kernel %s not available\n", kernel);
+        exit(EXIT_FAILURE);
+    }
+
+    /* -u is only a preference; without io_uring, fork as usual */
+    if (use_uring && !uring_available()) {
+        fprintf(stderr, "otp_enc_d: io_uring not available, ");
+        fprintf(stderr, "serving clients with processes instead\n");
+        use_uring = 0;
+    }
+
+    srand(time(0));
+
+    /* a client hanging up mid-reply should fail the write, not kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* SIGUSR1 dumps the metrics; no SA_RESTART, so it breaks the parent
+       out of accept() or wait() to do it */
+    init_metrics();
+    stats->pool_size = nworkers;
+    stats->threads = nthreads;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_dump;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (adminport && (admin_pid = spawn_admin(adminport)) < 0) {
+        fprintf(stderr, "otp_enc_d: unable to serve metrics on port %d\n",
+                adminport);
+        exit(EXIT_FAILURE);
+    }
+
+    /* get and use the port (or socket path) passed as argument to listen
+       on new socket */
+    portno = parse_port(argv[optind]);
+    servsockfd = listen_addr(argv[optind], nthreads > 0);
+
+    /* check reason for failure to listen on new socket, if any */
+    switch (servsockfd) {
+        case -3: {
+            fprintf(stderr, "otp_enc_d: unable to listen on port %s\n",
+                    argv[optind]);
+            close(servsockfd);
+            exit(EXIT_FAILURE);
+        }
+        case -2: {
+            fprintf(stderr, "otp_enc_d: unable to bind socket on port ");
+            fprintf(stderr, "%s\n", argv[optind]);
             close(servsockfd);
             exit(EXIT_FAILURE);
         }
         case -1: {
             fprintf(stderr, "otp_enc_d: unable to create socket on port ");
-            fprintf(stderr, "%d\n", portno);
+            fprintf(stderr, "%s\n", argv[optind]);
             exit(EXIT_FAILURE);
         }
         default:
             break;
     }
 
-    /* wait for client connections */
-    consockfd = accept(servsockfd, (struct sockaddr *) &cli_addr, &clilen);
-
-    /* got one, take care of the client and pass it off to a forked child,
-       then wait for the next client */
-    while (consockfd >= 0) {
-        /* try to handshake the client to make sure it's correct */
-        if (handshake(consockfd, sig, resp_sig, sizeof(resp_sig))) {
-            /* if so, propose a port for future communications and close
-               up the current socket */
-            consockfd = propose_port(consockfd, portno);
-
-            /* entrust a child process with the client */
-            pid = fork();
-
-            /* check whether process is child or parent */
-            switch (pid) {
-                /* failed fork */
-                case -1: {
-                    fprintf(stderr, "otp_enc_d: failed for fork child\n");
-                    close(consockfd);
-                    close(servsockfd);
-                    exit(EXIT_FAILURE);
-                }
-                /* child process */
-                case 0: {
-                    /* accept the client */
-                    int accsockfd = accept(consockfd,
-                            (struct sockaddr *) &cli_addr, &clilen);
-
-                    close(consockfd);
-
-                    /* get the data, encrypt, and send it back */
-                    process(accsockfd);
-                    close(accsockfd);
-                    exit(EXIT_SUCCESS);
-                }
-                default: {
-                    /* add the new child to the list */
-                    if (num_bg == max_bg) {
-                        max_bg += 10;
-                        if (!realloc(bg_pids, max_bg * sizeof(pid_t))) {
-                            free(bg_pids);
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-                    bg_pids[num_bg++] = pid;
+    /* with listener threads, each accepts and serves its own clients */
+    if (nthreads > 0) {
+        free(bg_pids);
+        if (!run_threads(argv[optind], servsockfd, nthreads, sig,
+                    resp_sig, sizeof(resp_sig))) {
+            close(servsockfd);
+            exit(EXIT_FAILURE);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    /* an io_uring loop in this process serves everyone, unless there is
+       a pool of them */
+    if (use_uring && nworkers == 0) {
+        free(bg_pids);
+        uring_loop(servsockfd, sig, resp_sig, sizeof(resp_sig));
+    }
+
+    /* with a worker pool, the workers do all the accepting from here on */
+    if (nworkers > 0) {
+        free(bg_pids);
+        if (!run_pool(servsockfd, nworkers, sig, resp_sig, sizeof(resp_sig))) {
+            close(servsockfd);
+            exit(EXIT_FAILURE);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    /* a child finishing breaks the parent out of accept(), like SIGUSR1,
+       so its place is free for the next client straight away */
+    sa.sa_handler = on_child;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    /* wait for client connections; each one is passed off to a forked
+       child before a word is read from it, so a client slow to say who
+       it is holds up only its own child, never the next accept */
+    for (;;) {
+        clilen = sizeof(cli_addr);
+        consockfd = accept(servsockfd, (struct sockaddr *) &cli_addr, &clilen);
+
+        if (consockfd < 0) {
+            /* a metrics dump, a child done, or a client that gave up;
+               keep going */
+            if (errno == EINTR || errno == ECONNABORTED) {
+                bg_check(&bg_pids, &num_bg, max_bg);
+                check_dump();
+                continue;
+            }
+            break;
+        }
+
+        /* no more children than clients allowed at once; the place is
+           the child's until it is reaped */
+        bg_check(&bg_pids, &num_bg, max_bg);
+        if (!admit()) {
+            refuse(consockfd);
+            continue;
+        }
 
-                    /* clean up finished children */        
-                    bg_check(&bg_pids, &num_bg, max_bg);
-                    break;
+        /* entrust a child process with the client */
+        pid = fork();
+
+        /* check whether process is child or parent */
+        switch (pid) {
+            /* failed fork: turn the client away and keep serving */
+            case -1: {
+                fprintf(stderr, "otp_enc_d: failed for fork child\n");
+                release();
+                stat_add(&stats->busy, 1);
+                refuse(consockfd);
+                continue;
+            }
+            /* child process */
+            case 0: {
+                signal(SIGUSR1, SIG_IGN);
+                signal(SIGCHLD, SIG_DFL);
+                close(servsockfd);
+                preadmitted = 1;
+
+                /* handshake, get the data, encrypt, and send it back */
+                serve_client(consockfd, sig, resp_sig, sizeof(resp_sig));
+                exit(EXIT_SUCCESS);
+            }
+            default: {
+                /* add the new child to the list */
+                if (num_bg == max_bg) {
+                    max_bg += 10;
+                    grown = realloc(bg_pids, max_bg * sizeof(pid_t));
+                    if (!grown) {
+                        free(bg_pids);
+                        exit(EXIT_FAILURE);
+                    }
+                    bg_pids = grown;
                 }
+                bg_pids[num_bg++] = pid;
+
+                /* clean up finished children */
+                bg_check(&bg_pids, &num_bg, max_bg);
+                break;
             }
         }
-        
+
         /* close the socket opened for a client */
         close(consockfd);
-
-        /* wait for a new client to connect */
-        consockfd = accept(servsockfd,
-                (struct sockaddr *) &cli_addr, &clilen);
     }
-  
+
     return EXIT_SUCCESS;
 }